@@ -0,0 +1,33 @@
+/*
+ * convert.c
+ *
+ *      Rewrites a device formatted with the original big endian
+ *      layout ('WFS' or 'WF2') in the native little endian one
+ *      ('WFL2' or 'WFL4').
+ *      If run from the command line without a parameter it
+ *      converts "device_file", otherwise the named device file.
+ *      Nothing else may use the device while it is converted.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "device.h"
+#include "fileSystem.h"
+
+int main(int argc, char *argv[]) {
+	if (argc > 1) {
+		struct DeviceOptions options = {DEVICE_MMAP, argv[1], 0, 0, DEVICE_SPARSE, 0};
+		if (configureDevice(&options)) {
+			fprintf(stderr, "usage: %s [device file]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	int error = convertLayout_r();
+	if (error) {
+		fprintf(stderr, "conversion failed (error %d)\n", error);
+		return EXIT_FAILURE;
+	}
+	printf("converted\n");
+	return EXIT_SUCCESS;
+}
@@ -4,37 +4,137 @@
  *  Modified on: 24/03/2023
  *      Author: Robert Sheehan
  *
- *  N.B. You are not allowed to modify this file, except as mentioned below.
+ *      The backends behind device.h, with each thread's current
+ *      device, pins and asynchronous requests.
  */
 
+#define _GNU_SOURCE // O_DIRECT
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE // defined by linux/fs.h, which io_uring.h pulls in - not the device's block size
+
 #include "device.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#define NUMBLOCKS 16 // you are allowed to change this value for further testing
+#define DIRECT_ALIGN 4096 // O_DIRECT transfers are aligned to this, which covers the common sector sizes
+#define ASYNC_DEPTH 64    // asynchronous requests each thread can have outstanding, also the io_uring size
+
+/*
+ * The operations a backend provides.
+ * read and write transfer count consecutive blocks starting at start.
+ * Backends that can keep transfers in flight also provide submit, which queues one
+ * for asynchronous request number request (or returns -1 if it can't, and the transfer
+ * is made straight away), and reap, which waits for at least one queued transfer to
+ * complete. Both are called with ringLock held, and are NULL for the other backends.
+ * zero clears count blocks from start without transferring them, it returns -1 when
+ * that is not possible and the zeros have to be written.
+ * discard releases the storage behind count blocks from start, where that is possible.
+ */
+struct DeviceBackend {
+    int (*connect)(void);
+    int (*read)(int start, int count, unsigned char *data);
+    int (*write)(int start, int count, const unsigned char *data);
+    void (*disconnect)(void);
+    int (*submit)(int write, int start, int count, unsigned char *data, int request);
+    int (*reap)(void);
+    int (*zero)(int start, int count);
+    int (*discard)(int start, int count);
+};
+
+/* The io_uring of a DEVICE_URING device. */
+struct UringQueue {
+    int fd; // -1 if the ring is not set up
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    int toSubmit; // queued but not yet handed to the kernel
+    int inFlight; // queued or in the kernel, at most ASYNC_DEPTH
+};
+
+/*
+ * A device and its connected backend.
+ * The block calls go to the calling thread's current device (see useDevice),
+ * the default one unless another has been chosen.
+ */
+struct Device {
+    struct DeviceOptions options;  // set by configureDevice or openDevice, before the device is first used
+    int blockSize;                 // the geometry, settled when the device is connected
+    int numBlocks;
+    unsigned char *blocks;         // the device as an array of blocks, only set by the backends that map it whole
+    int fd;                        // the device file, for the backends that transfer through a file descriptor
+    struct DeviceBackend *backend; // NULL until the device is first used
+    pthread_mutex_t connectLock;   // held while the backend is connected, so only the first thread to use it connects it
+    pthread_mutex_t directLock;    // held over each O_DIRECT write's read, modify and write of sectors other threads' blocks may share
+    struct UringQueue uring;
+    pthread_mutex_t ringLock;      // held to queue on the ring or reap from it, completions go to whichever thread's request they belong to
+    char *path;                    // copy of options.path made by openDevice, NULL for the default device
+};
+
+struct Device defaultDevice = {{DEVICE_MMAP, "device_file", 0, 0, DEVICE_SPARSE, 0}, DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS, NULL, -1, NULL,
+                               PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, {-1}, PTHREAD_MUTEX_INITIALIZER, NULL};
+
+/* The calling thread's current device. */
+_Thread_local struct Device *device = &defaultDevice;
+
+/* Address of a block in the mapped device. */
+#define BLOCK_ADDR(n) (device->blocks + (size_t)(n) * device->blockSize)
+
+/* The device error number, one per thread. */
+_Thread_local int dev_errno = 0;
+
+/*
+ * A block or span pinned on a backend without a mapping.
+ * It is a private copy, written back on unpin if it was pinned for writing.
+ * Each thread has its own pins, so a copy is never shared.
+ */
+struct Pin {
+    unsigned char *data; // NULL if the slot is free
+    int start;
+    int count;
+    int writable;
+};
 
-#define EBADBLOCK 1
-#define EOPENINGDEVICE 2
-#define ECREATINGMMAP 3
-#define EINSTALLATEXIT 4
+_Thread_local struct Pin pins[MAX_PINS];
 
-/* The device is really just an array of blocks. */
-block *deviceBlocks;
+/*
+ * An asynchronous request, from blockReadAsync or blockWriteAsync until blockWait collects it.
+ * Request numbers belong to the thread that started them.
+ */
+struct AsyncRequest {
+    int inUse;
+    int done;     // set by whichever thread reaps the completion, under ringLock
+    int result;   // 0 or -1 once done
+    int expected; // bytes a request on the io_uring should transfer
+};
 
-/* The device error number. */
-int dev_errno = 0;
+_Thread_local struct AsyncRequest requests[ASYNC_DEPTH];
 
 /*
  * Prints the message and then information about the most recent error.
  */
 void printDevError(char *message) {
-    fprintf(stderr, "%s ERROR: %i ", message, BLOCK_SIZE);
+    fprintf(stderr, "%s ERROR: %i ", message, device->blockSize);
     switch (dev_errno) {
     case EBADBLOCK:
         fprintf(stderr, "bad block number\n");
@@ -48,51 +148,550 @@ void printDevError(char *message) {
     case EINSTALLATEXIT:
         fprintf(stderr, "unable to install atexit handler\n");
         break;
+    case EDEVICEIO:
+        fprintf(stderr, "unable to transfer data to or from the device\n");
+        break;
+    case EBADCONFIG:
+        fprintf(stderr, "unable to configure device\n");
+        break;
+    case ETOOMANYPINS:
+        fprintf(stderr, "too many blocks pinned\n");
+        break;
+    case ETOOMANYREQUESTS:
+        fprintf(stderr, "too many asynchronous requests outstanding\n");
+        break;
     default:
         fprintf(stderr, "unknown error\n");
     }
 }
 
 /*
- * Ensures the data is flushed back to disk when the program exits.
+ * Checks a block size and number of blocks make a usable device.
+ * Returns 1 if they do, 0 otherwise.
  */
-void removeDevice() {
-    if (munmap(deviceBlocks, NUMBLOCKS * BLOCK_SIZE) == -1) {
-        perror("ERROR removing mmap");
+int validGeometry(int blockSize, int numBlocks) {
+    if (blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0) {
+        return 0;
     }
+    return numBlocks > 0 && (off_t)numBlocks * blockSize <= ((off_t)1 << 40);
 }
 
 /*
- * Connects an area of memory with the file representing the device.
- * Only called once each time the program is run.
+ * Decodes a 4 byte big endian value from the geometry record.
  */
-int connectDevice() {
+int decodeGeometryField(const unsigned char *field) {
+    return (int)(((unsigned)field[0] << 24) | ((unsigned)field[1] << 16) | ((unsigned)field[2] << 8) | field[3]);
+}
+
+/*
+ * Settles the geometry of the device file - the device's own record, or the
+ * legacy 64 byte blocks filling the file, overridden by any configured values.
+ */
+void loadGeometry(int dev_fd, off_t fileSize) {
+    unsigned char record[GEOMETRY_SIZE];
+    device->blockSize = DEFAULT_BLOCK_SIZE;
+    device->numBlocks = DEFAULT_NUM_BLOCKS;
+    if (fileSize >= GEOMETRY_OFFSET + GEOMETRY_SIZE && pread(dev_fd, record, GEOMETRY_SIZE, GEOMETRY_OFFSET) == GEOMETRY_SIZE &&
+        memcmp(record, "WGEO", 4) == 0 && validGeometry(decodeGeometryField(record + 4), decodeGeometryField(record + 8))) {
+        device->blockSize = decodeGeometryField(record + 4);
+        device->numBlocks = decodeGeometryField(record + 8);
+    } else if (fileSize >= MIN_BLOCK_SIZE) {
+        device->blockSize = MIN_BLOCK_SIZE;
+        device->numBlocks = fileSize / MIN_BLOCK_SIZE;
+    }
+
+    if (device->options.blockSize != 0) {
+        device->blockSize = device->options.blockSize;
+    }
+    if (device->options.numBlocks != 0) {
+        device->numBlocks = device->options.numBlocks;
+    }
+}
+
+/*
+ * Opens the device file, settles the geometry and makes the file big enough for it,
+ * rounded up to a multiple of align. A configured geometry also trims a larger file.
+ * Returns the file descriptor, or -1 if there is a problem.
+ */
+int openDeviceFile(int align) {
     int dev_fd;
     struct stat fileStatus;
 
-    if ((dev_fd = open("device_file", O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) == -1) {
+    if ((dev_fd = open(device->options.path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) == -1) {
         dev_errno = EOPENINGDEVICE;
         return -1;
     }
     if (fstat(dev_fd, &fileStatus)) {
         dev_errno = EOPENINGDEVICE;
+        close(dev_fd);
         return -1;
     }
-    int size = fileStatus.st_size;
-    unsigned char data[BLOCK_SIZE]; // could be garbage until formatted
-    while (size < NUMBLOCKS * BLOCK_SIZE) {
-        if (write(dev_fd, data, BLOCK_SIZE) == -1) {
+    off_t fileSize = fileStatus.st_size;
+    loadGeometry(dev_fd, fileSize);
+
+    off_t size = ((off_t)device->numBlocks * device->blockSize + align - 1) / align * align;
+    if (fileSize > size && (device->options.blockSize != 0 || device->options.numBlocks != 0)) {
+        if (ftruncate(dev_fd, size) == -1) {
             dev_errno = EOPENINGDEVICE;
+            close(dev_fd);
             return -1;
         }
-        size += BLOCK_SIZE;
     }
-    deviceBlocks = (block *)mmap(NULL, NUMBLOCKS * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, 0);
-    if ((long)deviceBlocks == -1) {
+
+    // Grown in one call, the new blocks read as zeros until formatted
+    if (fileSize < size) {
+        int failed = (device->options.allocation == DEVICE_PREALLOCATE) ? posix_fallocate(dev_fd, fileSize, size - fileSize) != 0
+                                                                      : ftruncate(dev_fd, size) == -1;
+        if (failed) {
+            dev_errno = EOPENINGDEVICE;
+            close(dev_fd);
+            return -1;
+        }
+    }
+    return dev_fd;
+}
+
+/*
+ * Clears blocks of the device file without writing them, for the backends with a file.
+ * A sparse device has a hole punched, which frees the space. A preallocated one keeps
+ * its space, ZERO_RANGE allocates every block in the range.
+ */
+int fileZero(int start, int count) {
+    off_t offset = (off_t)start * device->blockSize;
+    off_t length = (off_t)count * device->blockSize;
+    int mode = (device->options.allocation == DEVICE_PREALLOCATE) ? FALLOC_FL_ZERO_RANGE : FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+    return fallocate(device->fd, mode, offset, length) == 0 ? 0 : -1;
+}
+
+/*
+ * Punches a hole for blocks of the device file, which also drops them from the page cache
+ * (and from the mapping). File systems without holes keep the storage.
+ */
+int fileDiscard(int start, int count) {
+    if (fallocate(device->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)start * device->blockSize,
+                  (off_t)count * device->blockSize) == 0 || errno == EOPNOTSUPP) {
+        return 0;
+    }
+    dev_errno = EDEVICEIO;
+    return -1;
+}
+
+/*
+ * Transfers for the backends that hold the whole device in memory.
+ */
+int mappedRead(int start, int count, unsigned char *data) {
+    memcpy(data, BLOCK_ADDR(start), (size_t)count * device->blockSize);
+    return 0;
+}
+
+int mappedWrite(int start, int count, const unsigned char *data) {
+    memcpy(BLOCK_ADDR(start), data, (size_t)count * device->blockSize);
+    return 0;
+}
+
+/*
+ * Connects an area of memory with the file representing the device.
+ */
+int mmapConnect() {
+    int dev_fd = openDeviceFile(1);
+    if (dev_fd == -1) {
+        return -1;
+    }
+    device->blocks = mmap(NULL, (size_t)device->numBlocks * device->blockSize, PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, 0);
+    if (device->blocks == MAP_FAILED) {
+        device->blocks = NULL;
         dev_errno = ECREATINGMMAP;
+        close(dev_fd);
         return -1;
     }
-    if (atexit(removeDevice)) {
+    device->fd = dev_fd; // kept open for fileZero, the mapping sees the cleared blocks
+    return 0;
+}
+
+/*
+ * Ensures the data is flushed back to disk when the program exits.
+ */
+void mmapDisconnect() {
+    if (munmap(device->blocks, (size_t)device->numBlocks * device->blockSize) == -1) {
+        perror("ERROR removing mmap");
+    }
+    if (device->fd != -1 && close(device->fd) == -1) {
+        perror("ERROR closing device");
+    }
+}
+
+struct DeviceBackend mmapBackend = {mmapConnect, mappedRead, mappedWrite, mmapDisconnect, NULL, NULL, fileZero, fileDiscard};
+
+/*
+ * Transfers through pread/pwrite on the device file, via the page cache.
+ */
+int preadConnect() {
+    device->fd = openDeviceFile(1);
+    return (device->fd == -1) ? -1 : 0;
+}
+
+int preadRead(int start, int count, unsigned char *data) {
+    size_t length = (size_t)count * device->blockSize;
+    if (pread(device->fd, data, length, (off_t)start * device->blockSize) != (ssize_t)length) {
+        dev_errno = EDEVICEIO;
+        return -1;
+    }
+    return 0;
+}
+
+int preadWrite(int start, int count, const unsigned char *data) {
+    size_t length = (size_t)count * device->blockSize;
+    if (pwrite(device->fd, data, length, (off_t)start * device->blockSize) != (ssize_t)length) {
+        dev_errno = EDEVICEIO;
+        return -1;
+    }
+    return 0;
+}
+
+void fileDisconnect() {
+    if (close(device->fd) == -1) {
+        perror("ERROR closing device");
+    }
+}
+
+struct DeviceBackend preadBackend = {preadConnect, preadRead, preadWrite, fileDisconnect, NULL, NULL, fileZero, fileDiscard};
+
+/*
+ * Transfers with O_DIRECT, bypassing the page cache.
+ * Blocks are smaller than the O_DIRECT alignment, so every transfer goes through
+ * an aligned bounce buffer covering the whole sectors the blocks sit in.
+ */
+
+int directConnect() {
+    // Size the file through an ordinary descriptor, unaligned writes fail under O_DIRECT
+    int dev_fd = openDeviceFile(DIRECT_ALIGN);
+    if (dev_fd == -1) {
+        return -1;
+    }
+    close(dev_fd);
+
+    if ((device->fd = open(device->options.path, O_RDWR | O_DIRECT)) == -1) {
+        dev_errno = EOPENINGDEVICE;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reads the aligned sectors holding count blocks from start into a new bounce buffer.
+ * Returns the buffer, or NULL if there is a problem.
+ * The sectors' offset and length are put in sectorStart and length, and the
+ * position of block start within the buffer in skip.
+ */
+unsigned char *directReadSectors(int start, int count, off_t *sectorStart, int *length, int *skip) {
+    off_t first = (off_t)start * device->blockSize;
+    off_t end = first + (off_t)count * device->blockSize;
+    *sectorStart = first / DIRECT_ALIGN * DIRECT_ALIGN;
+    *length = (int)((end + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN - *sectorStart);
+    *skip = (int)(first - *sectorStart);
+
+    void *bounce;
+    if (posix_memalign(&bounce, DIRECT_ALIGN, *length)) {
+        dev_errno = EDEVICEIO;
+        return NULL;
+    }
+    if (pread(device->fd, bounce, *length, *sectorStart) != *length) {
+        dev_errno = EDEVICEIO;
+        free(bounce);
+        return NULL;
+    }
+    return bounce;
+}
+
+int directRead(int start, int count, unsigned char *data) {
+    off_t sectorStart;
+    int length;
+    int skip;
+    unsigned char *bounce = directReadSectors(start, count, &sectorStart, &length, &skip);
+    if (bounce == NULL) {
+        return -1;
+    }
+    memcpy(data, bounce + skip, (size_t)count * device->blockSize);
+    free(bounce);
+    return 0;
+}
+
+int directWrite(int start, int count, const unsigned char *data) {
+    off_t sectorStart;
+    int length;
+    int skip;
+    pthread_mutex_lock(&device->directLock);
+    unsigned char *bounce = directReadSectors(start, count, &sectorStart, &length, &skip);
+    if (bounce == NULL) {
+        pthread_mutex_unlock(&device->directLock);
+        return -1;
+    }
+    memcpy(bounce + skip, data, (size_t)count * device->blockSize);
+    int written = pwrite(device->fd, bounce, length, sectorStart);
+    pthread_mutex_unlock(&device->directLock);
+    free(bounce);
+    if (written != length) {
+        dev_errno = EDEVICEIO;
+        return -1;
+    }
+    return 0;
+}
+
+struct DeviceBackend directBackend = {directConnect, directRead, directWrite, fileDisconnect, NULL, NULL, fileZero, fileDiscard};
+
+/*
+ * Holds the device in anonymous memory. Nothing is kept after the program exits.
+ */
+int ramConnect() {
+    if (device->options.blockSize != 0) {
+        device->blockSize = device->options.blockSize;
+    }
+    if (device->options.numBlocks != 0) {
+        device->numBlocks = device->options.numBlocks;
+    }
+    device->blocks = mmap(NULL, (size_t)device->numBlocks * device->blockSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (device->blocks == MAP_FAILED) {
+        device->blocks = NULL;
+        dev_errno = ECREATINGMMAP;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Hands whole pages back to the kernel, which zero fills them when they are next touched.
+ */
+int ramZero(int start, int count) {
+    unsigned char *from = BLOCK_ADDR(start);
+    unsigned char *to = BLOCK_ADDR(start + count);
+    size_t page = sysconf(_SC_PAGESIZE);
+    unsigned char *firstPage = (unsigned char *)(((uintptr_t)from + page - 1) / page * page);
+    unsigned char *lastPage = (unsigned char *)((uintptr_t)to / page * page);
+    if (firstPage >= lastPage) {
+        memset(from, 0, to - from);
+        return 0;
+    }
+
+    memset(from, 0, firstPage - from);
+    memset(lastPage, 0, to - lastPage);
+    return madvise(firstPage, lastPage - firstPage, MADV_DONTNEED) == 0 ? 0 : -1;
+}
+
+struct DeviceBackend ramBackend = {ramConnect, mappedRead, mappedWrite, mmapDisconnect, NULL, NULL, ramZero, ramZero};
+
+/*
+ * Transfers through pread/pwrite like DEVICE_PREAD, with asynchronous requests queued on an io_uring.
+ * Queued requests are only handed to the kernel, in one batch, when something waits for one.
+ */
+/*
+ * Sets up the io_uring and maps its queues.
+ * Returns -1 if the kernel does not support everything needed, 0 otherwise.
+ */
+int uringSetup() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, ASYNC_DEPTH, &params);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // IORING_OP_READ and IORING_OP_WRITE arrived with the probe interface
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probeSize);
+    if (probe == NULL || syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0 ||
+        probe->last_op < IORING_OP_WRITE || !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+        !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)) {
+        free(probe);
+        close(fd);
+        return -1;
+    }
+    free(probe);
+
+    device->uring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    device->uring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (device->uring.cqRingSize > device->uring.sqRingSize) {
+            device->uring.sqRingSize = device->uring.cqRingSize;
+        }
+        device->uring.cqRingSize = device->uring.sqRingSize;
+    }
+    device->uring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    device->uring.sqRing = mmap(NULL, device->uring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (device->uring.sqRing == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    device->uring.cqRing = device->uring.sqRing;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        device->uring.cqRing = mmap(NULL, device->uring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (device->uring.cqRing == MAP_FAILED) {
+            munmap(device->uring.sqRing, device->uring.sqRingSize);
+            close(fd);
+            return -1;
+        }
+    }
+    device->uring.sqes = mmap(NULL, device->uring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (device->uring.sqes == MAP_FAILED) {
+        if (device->uring.cqRing != device->uring.sqRing) {
+            munmap(device->uring.cqRing, device->uring.cqRingSize);
+        }
+        munmap(device->uring.sqRing, device->uring.sqRingSize);
+        close(fd);
+        return -1;
+    }
+
+    char *sq = device->uring.sqRing;
+    char *cq = device->uring.cqRing;
+    device->uring.sqHead = (unsigned *)(sq + params.sq_off.head);
+    device->uring.sqTail = (unsigned *)(sq + params.sq_off.tail);
+    device->uring.sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    device->uring.sqArray = (unsigned *)(sq + params.sq_off.array);
+    device->uring.cqHead = (unsigned *)(cq + params.cq_off.head);
+    device->uring.cqTail = (unsigned *)(cq + params.cq_off.tail);
+    device->uring.cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    device->uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    device->uring.toSubmit = 0;
+    device->uring.inFlight = 0;
+    device->uring.fd = fd;
+    return 0;
+}
+
+/*
+ * Opens the device file and sets up the ring.
+ * A kernel without io_uring is not an error - connectDevice falls back to DEVICE_PREAD.
+ */
+int uringConnect() {
+    if (preadConnect()) {
+        return -1;
+    }
+    uringSetup();
+    return 0;
+}
+
+/*
+ * Queues a transfer on the ring, with ringLock held.
+ * Returns -1 if ASYNC_DEPTH transfers are already on it, 0 otherwise.
+ */
+int uringSubmit(int write, int start, int count, unsigned char *data, int request) {
+    if (device->uring.inFlight == ASYNC_DEPTH) {
+        return -1; // the ring is shared by every thread, this one's request goes without it
+    }
+
+    unsigned tail = *device->uring.sqTail; // only this process adds entries
+    unsigned idx = tail & *device->uring.sqMask;
+    struct io_uring_sqe *sqe = &device->uring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = device->fd;
+    sqe->addr = (unsigned long)data;
+    sqe->len = count * device->blockSize;
+    sqe->off = (unsigned long long)start * device->blockSize;
+    sqe->user_data = (uintptr_t)&requests[request];
+    device->uring.sqArray[idx] = idx;
+    __atomic_store_n(device->uring.sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    requests[request].expected = count * device->blockSize;
+    device->uring.toSubmit++;
+    device->uring.inFlight++;
+    return 0;
+}
+
+/*
+ * Hands any queued transfers to the kernel and waits for at least one completion, with ringLock held.
+ * Returns 0 if successful, -1 if an error occurred.
+ */
+int uringReap() {
+    while (1) {
+        unsigned head = *device->uring.cqHead;
+        unsigned tail = __atomic_load_n(device->uring.cqTail, __ATOMIC_ACQUIRE);
+        if (head != tail) {
+            for (; head != tail; head++) {
+                struct io_uring_cqe *cqe = &device->uring.cqes[head & *device->uring.cqMask];
+                struct AsyncRequest *request = (struct AsyncRequest *)(uintptr_t)cqe->user_data;
+                request->result = (cqe->res == request->expected) ? 0 : -1;
+                request->done = 1;
+                device->uring.inFlight--;
+            }
+            __atomic_store_n(device->uring.cqHead, head, __ATOMIC_RELEASE);
+            return 0;
+        }
+
+        int submitted = syscall(__NR_io_uring_enter, device->uring.fd, device->uring.toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            dev_errno = EDEVICEIO;
+            return -1;
+        }
+        device->uring.toSubmit -= submitted;
+    }
+}
+
+void uringDisconnect() {
+    munmap(device->uring.sqes, device->uring.sqesSize);
+    if (device->uring.cqRing != device->uring.sqRing) {
+        munmap(device->uring.cqRing, device->uring.cqRingSize);
+    }
+    munmap(device->uring.sqRing, device->uring.sqRingSize);
+    close(device->uring.fd);
+    fileDisconnect();
+}
+
+struct DeviceBackend uringBackend = {uringConnect, preadRead, preadWrite, uringDisconnect, uringSubmit, uringReap, fileZero, fileDiscard};
+
+/*
+ * Disconnects the default device when the program exits.
+ */
+void removeDevice() {
+    device = &defaultDevice;
+    device->backend->disconnect();
+}
+
+/*
+ * Checks the options name a backend and allocation, and a geometry where they give one.
+ * Returns 1 if they do, 0 otherwise.
+ */
+int validOptions(const struct DeviceOptions *options) {
+    return options->backend >= DEVICE_MMAP && options->backend <= DEVICE_URING &&
+           (options->allocation == DEVICE_SPARSE || options->allocation == DEVICE_PREALLOCATE) &&
+           validGeometry(options->blockSize != 0 ? options->blockSize : DEFAULT_BLOCK_SIZE, options->numBlocks != 0 ? options->numBlocks : 1);
+}
+
+/*
+ * Chooses how the current device is accessed.
+ * Must be called before the device is first used.
+ * Returns 0 if successful, -1 if an error occurred.
+ */
+int configureDevice(const struct DeviceOptions *options) {
+    if (device->backend != NULL || !validOptions(options)) {
+        dev_errno = EBADCONFIG;
+        return -1;
+    }
+    device->options = *options;
+    if (device->options.path == NULL) {
+        device->options.path = "device_file";
+    }
+    return 0;
+}
+
+/*
+ * Connects the configured backend, with connectLock held.
+ * Only called once for each device.
+ */
+int connectDevice() {
+    struct DeviceBackend *backends[] = {&mmapBackend, &preadBackend, &directBackend, &ramBackend, &uringBackend};
+    struct DeviceBackend *chosen = backends[device->options.backend];
+
+    if (chosen->connect()) {
+        return -1;
+    }
+    if (chosen == &uringBackend && device->uring.fd == -1) {
+        chosen = &preadBackend; // no io_uring in this kernel, the file is already open for pread
+    }
+    __atomic_store_n(&device->backend, chosen, __ATOMIC_RELEASE);
+    if (device == &defaultDevice && atexit(removeDevice)) {
         dev_errno = EINSTALLATEXIT;
         return -1;
     }
@@ -105,12 +704,94 @@ int connectDevice() {
  * Returns -1 if there is a problem, 0 otherwise.
  */
 int badDevice() {
-    static int unconnected = 1;
-    if (unconnected) {
-        if (connectDevice()) {
-            return -1;
-        }
-        unconnected = 0;
+    if (__atomic_load_n(&device->backend, __ATOMIC_ACQUIRE) != NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&device->connectLock);
+    int result = (device->backend == NULL) ? connectDevice() : 0;
+    pthread_mutex_unlock(&device->connectLock);
+    return result;
+}
+
+/*
+ * Makes dev the calling thread's current device, NULL for the default one.
+ * Returns the previous current device.
+ */
+struct Device *useDevice(struct Device *dev) {
+    struct Device *previous = device;
+    device = (dev != NULL) ? dev : &defaultDevice;
+    return previous;
+}
+
+/*
+ * Opens a device of its own, separate from the default one, and connects it.
+ * Returns the device, or NULL if an error occurred.
+ */
+struct Device *openDevice(const struct DeviceOptions *options) {
+    if (!validOptions(options)) {
+        dev_errno = EBADCONFIG;
+        return NULL;
+    }
+    struct Device *dev = calloc(1, sizeof(struct Device));
+    char *path = strdup(options->path != NULL ? options->path : "device_file");
+    if (dev == NULL || path == NULL) {
+        dev_errno = EOPENINGDEVICE;
+        free(dev);
+        free(path);
+        return NULL;
+    }
+
+    dev->options = *options;
+    dev->options.path = path;
+    dev->path = path;
+    dev->blockSize = DEFAULT_BLOCK_SIZE;
+    dev->numBlocks = DEFAULT_NUM_BLOCKS;
+    dev->fd = -1;
+    dev->uring.fd = -1;
+    pthread_mutex_init(&dev->connectLock, NULL);
+    pthread_mutex_init(&dev->directLock, NULL);
+    pthread_mutex_init(&dev->ringLock, NULL);
+
+    struct Device *previous = useDevice(dev);
+    int failed = connectDevice();
+    useDevice(previous);
+    if (failed) {
+        closeDevice(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+/*
+ * Disconnects and frees a device from openDevice.
+ */
+void closeDevice(struct Device *dev) {
+    if (dev == NULL || dev == &defaultDevice) {
+        return;
+    }
+    if (dev->backend != NULL) {
+        struct Device *previous = useDevice(dev);
+        dev->backend->disconnect();
+        useDevice(previous);
+    }
+    pthread_mutex_destroy(&dev->connectLock);
+    pthread_mutex_destroy(&dev->directLock);
+    pthread_mutex_destroy(&dev->ringLock);
+    free(dev->path);
+    free(dev);
+}
+
+/*
+ * Checks the device is attached and count blocks from start are all on it.
+ * Returns -1 if there is a problem, 0 otherwise.
+ */
+int badRange(int start, int count) {
+    if (badDevice())
+        return -1;
+    if (start < 0 || count < 0 || count > device->numBlocks - start) {
+        dev_errno = EBADBLOCK;
+        return -1;
     }
     return 0;
 }
@@ -119,43 +800,348 @@ int badDevice() {
  * Read a block of data from the device.
  * blockNumber - the number of the block to read
  * data - the address of the position to put the block data
- * The data must be exactly BLOCK_SIZE long.
+ * The data must be exactly blockSize() long.
  * Returns 0 if successful, -1 if an error occurred.
  */
 int blockRead(int blockNumber, unsigned char *data) {
-    if (badDevice())
-        return -1;
-    if (blockNumber < 0 || blockNumber > NUMBLOCKS - 1) {
-        dev_errno = EBADBLOCK;
+    if (badRange(blockNumber, 1))
         return -1;
-    }
-    memcpy(data, deviceBlocks[blockNumber], BLOCK_SIZE);
-    return 0;
+    return device->backend->read(blockNumber, 1, data);
 }
 
 /*
  * Write a block of data to the device.
  * blockNumber - the number of the block to write
  * data - the address of the position to get the block data
- * The data must be exactly BLOCK_SIZE long.
+ * The data must be exactly blockSize() long.
  * Returns 0 if successful, -1 if an error occurred.
  */
 int blockWrite(int blockNumber, unsigned char *data) {
-    if (badDevice())
+    if (badRange(blockNumber, 1))
         return -1;
-    if (blockNumber < 0 || blockNumber > NUMBLOCKS - 1) {
-        dev_errno = EBADBLOCK;
+    return device->backend->write(blockNumber, 1, data);
+}
+
+/*
+ * Starts an asynchronous transfer.
+ * Backends without asynchronous support complete it straight away.
+ * Returns the request number, or -1 if an error occurred.
+ */
+int startAsync(int write, int start, int count, unsigned char *data) {
+    if (badRange(start, count))
+        return -1;
+
+    for (int i = 0; i < ASYNC_DEPTH; i++) {
+        if (!requests[i].inUse) {
+            requests[i].inUse = 1;
+            requests[i].done = 0;
+            int queued = -1;
+            if (device->backend->submit != NULL) {
+                pthread_mutex_lock(&device->ringLock);
+                queued = device->backend->submit(write, start, count, data, i);
+                pthread_mutex_unlock(&device->ringLock);
+            }
+            if (queued) {
+                requests[i].result = write ? device->backend->write(start, count, data) : device->backend->read(start, count, data);
+                requests[i].done = 1;
+            }
+            return i;
+        }
+    }
+    dev_errno = ETOOMANYREQUESTS;
+    return -1;
+}
+
+/*
+ * Starts reading count consecutive blocks from start into data without waiting for them.
+ * Returns the request number, or -1 if an error occurred.
+ */
+int blockReadAsync(int start, int count, unsigned char *data) {
+    return startAsync(0, start, count, data);
+}
+
+/*
+ * Starts writing count consecutive blocks at start from data without waiting for them.
+ * Returns the request number, or -1 if an error occurred.
+ */
+int blockWriteAsync(int start, int count, unsigned char *data) {
+    return startAsync(1, start, count, data);
+}
+
+/*
+ * Waits for an asynchronous request to complete and releases it.
+ * Returns 0 if the transfer succeeded, -1 if it or the wait failed.
+ */
+int blockWait(int request) {
+    if (request < 0 || request >= ASYNC_DEPTH || !requests[request].inUse) {
+        dev_errno = EBADCONFIG;
+        return -1;
+    }
+    if (device->backend->reap != NULL) {
+        pthread_mutex_lock(&device->ringLock);
+        while (!requests[request].done) {
+            if (device->backend->reap()) {
+                pthread_mutex_unlock(&device->ringLock);
+                return -1;
+            }
+        }
+        pthread_mutex_unlock(&device->ringLock);
+    }
+
+    requests[request].inUse = 0;
+    if (requests[request].result) {
+        dev_errno = EDEVICEIO;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Transfers runs of consecutive blocks to or from consecutive buffers together.
+ * Where the backend supports it every run is in flight at once.
+ * Returns 0 if successful, -1 if an error occurred.
+ */
+int transferRuns(int write, const int *blocks, unsigned char **bufs, int n) {
+    int inFlight[ASYNC_DEPTH];
+    int nInFlight = 0;
+    int result = 0;
+
+    int i = 0;
+    while (i < n) {
+        int run = 1;
+        while (i + run < n && blocks[i + run] == blocks[i] + run && bufs[i + run] == bufs[i] + (size_t)run * device->blockSize) {
+            run++;
+        }
+
+        int request = -1;
+        if (device->backend->submit != NULL && nInFlight < ASYNC_DEPTH) {
+            request = startAsync(write, blocks[i], run, bufs[i]);
+        }
+        if (request >= 0) {
+            inFlight[nInFlight++] = request;
+        } else if ((write ? device->backend->write(blocks[i], run, bufs[i]) : device->backend->read(blocks[i], run, bufs[i]))) {
+            result = -1;
+            break;
+        }
+        i += run;
+    }
+
+    for (int r = 0; r < nInFlight; r++) {
+        if (blockWait(inFlight[r])) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/*
+ * Checks every block number of a vectored request before any data moves.
+ * Returns -1 if there is a problem, 0 otherwise.
+ */
+int badBlocks(const int *blocks, int n) {
+    for (int i = 0; i < n; i++) {
+        if (badRange(blocks[i], 1))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read several blocks in one call.
+ * Runs of consecutive blocks going to consecutive buffers are transferred together.
+ * Returns 0 if successful, -1 if an error occurred.
+ */
+int blockReadv(const int *blocks, unsigned char **bufs, int n) {
+    if (badBlocks(blocks, n))
+        return -1;
+    return transferRuns(0, blocks, bufs, n);
+}
+
+/*
+ * Write several blocks in one call.
+ * Runs of consecutive blocks coming from consecutive buffers are transferred together.
+ * Returns 0 if successful, -1 if an error occurred.
+ */
+int blockWritev(const int *blocks, unsigned char **bufs, int n) {
+    if (badBlocks(blocks, n))
+        return -1;
+    return transferRuns(1, blocks, bufs, n);
+}
+
+/*
+ * Read count consecutive blocks starting at start into data.
+ * Returns 0 if successful, -1 if an error occurred.
+ */
+int blockReadRange(int start, int count, unsigned char *data) {
+    if (badRange(start, count))
+        return -1;
+    return (count == 0) ? 0 : device->backend->read(start, count, data);
+}
+
+/*
+ * Write count consecutive blocks starting at start from data.
+ * Returns 0 if successful, -1 if an error occurred.
+ */
+int blockWriteRange(int start, int count, unsigned char *data) {
+    if (badRange(start, count))
+        return -1;
+    return (count == 0) ? 0 : device->backend->write(start, count, data);
+}
+
+#define ZERO_CHUNK_BLOCKS 64 // blocks written per transfer when the backend can't clear them
+
+/*
+ * Sets count consecutive blocks starting at start to zeros.
+ * Returns 0 if successful, -1 if an error occurred.
+ */
+int blockZeroRange(int start, int count) {
+    if (badRange(start, count))
+        return -1;
+    if (count == 0 || device->backend->zero(start, count) == 0)
+        return 0;
+
+    unsigned char *zeros = calloc(ZERO_CHUNK_BLOCKS, device->blockSize);
+    if (zeros == NULL) {
+        dev_errno = EDEVICEIO;
         return -1;
     }
-    memcpy(deviceBlocks[blockNumber], data, BLOCK_SIZE);
+    for (int i = 0; i < count; i += ZERO_CHUNK_BLOCKS) {
+        int chunk = (count - i < ZERO_CHUNK_BLOCKS) ? count - i : ZERO_CHUNK_BLOCKS;
+        if (device->backend->write(start + i, chunk, zeros)) {
+            free(zeros);
+            return -1;
+        }
+    }
+    free(zeros);
     return 0;
 }
 
+/*
+ * Tells the device blocks are no longer used, releasing their storage if configured to.
+ * Returns 0 if successful, -1 if an error occurred.
+ */
+int blockDiscard(int start, int count) {
+    if (badRange(start, count))
+        return -1;
+    if (count == 0 || !device->options.discard)
+        return 0;
+    return device->backend->discard(start, count);
+}
+
+/*
+ * Pins count blocks starting at start.
+ * Backends that map the whole device hand out the mapping itself, the others a private copy.
+ * Returns the address, or NULL if an error occurred.
+ */
+unsigned char *pinBlocks(int start, int count, int writable) {
+    if (badRange(start, count))
+        return NULL;
+    if (count < 1) {
+        dev_errno = EBADBLOCK;
+        return NULL;
+    }
+    if (device->blocks != NULL) {
+        return BLOCK_ADDR(start);
+    }
+
+    for (int i = 0; i < MAX_PINS; i++) {
+        if (pins[i].data == NULL) {
+            unsigned char *data = malloc((size_t)count * device->blockSize);
+            if (data == NULL) {
+                dev_errno = EDEVICEIO;
+                return NULL;
+            }
+            if (device->backend->read(start, count, data)) {
+                free(data);
+                return NULL;
+            }
+            pins[i].data = data;
+            pins[i].start = start;
+            pins[i].count = count;
+            pins[i].writable = writable;
+            return data;
+        }
+    }
+    dev_errno = ETOOMANYPINS;
+    return NULL;
+}
+
+/*
+ * Gives direct read access to a block, without copying it where the device is mapped.
+ * Returns the address of the block, or NULL if an error occurred.
+ */
+const unsigned char *blockPin(int blockNumber) {
+    return pinBlocks(blockNumber, 1, 0);
+}
+
+/*
+ * As blockPin, but the block may also be modified through the returned address.
+ * Where the device is mapped, writes go straight to the device.
+ */
+unsigned char *blockPinMut(int blockNumber) {
+    return pinBlocks(blockNumber, 1, 1);
+}
+
+/*
+ * Gives direct read access to count consecutive blocks starting at start.
+ * Returns the address of the first block, or NULL if an error occurred.
+ */
+const unsigned char *blockSpan(int start, int count) {
+    return pinBlocks(start, count, 0);
+}
+
+/*
+ * Releases a pinned block or span, writing a copy pinned for writing back to the device.
+ * Returns 0 if successful, -1 if an error occurred.
+ */
+int blockUnpin(const unsigned char *data) {
+    if (device->blocks != NULL) {
+        return 0; // the mapping itself was handed out
+    }
+
+    for (int i = 0; i < MAX_PINS; i++) {
+        if (pins[i].data != NULL && pins[i].data == data) {
+            int result = 0;
+            if (pins[i].writable) {
+                result = device->backend->write(pins[i].start, pins[i].count, pins[i].data);
+            }
+            free(pins[i].data);
+            pins[i].data = NULL;
+            return result;
+        }
+    }
+    dev_errno = EBADBLOCK;
+    return -1;
+}
+
 /*
  * Reports the number of blocks in the device.
  */
 int numBlocks() {
-    return NUMBLOCKS;
+    badDevice(); // the geometry is settled on connection
+    return device->numBlocks;
+}
+
+/*
+ * Reports the size of each block in bytes.
+ */
+int blockSize() {
+    badDevice();
+    return device->blockSize;
+}
+
+/*
+ * Fills record with the geometry record for the device.
+ */
+void geometryRecord(unsigned char *record) {
+    int fields[2] = {blockSize(), numBlocks()};
+    memcpy(record, "WGEO", 4);
+    for (int i = 0; i < 2; i++) {
+        record[4 + 4 * i] = (unsigned char)(fields[i] >> 24);
+        record[5 + 4 * i] = (unsigned char)(fields[i] >> 16);
+        record[6 + 4 * i] = (unsigned char)(fields[i] >> 8);
+        record[7 + 4 * i] = (unsigned char)fields[i];
+    }
 }
 
 /*
@@ -163,8 +1149,8 @@ int numBlocks() {
  * Not really a device function, just for debugging and marking.
  */
 void displayBlock(int blockNumber) {
-    block b;
-    if (blockRead(blockNumber, b)) {
+    unsigned char *b = malloc(blockSize());
+    if (b == NULL || blockRead(blockNumber, b)) {
         printDevError("-- displayBlock --");
     } else {
         printf("\nBlock %d\n", blockNumber);
@@ -173,7 +1159,7 @@ void displayBlock(int blockNumber) {
         int col;
         const int number_per_row = 16;
         unsigned char *byte = b;
-        for (row = 0; row < BLOCK_SIZE / number_per_row; ++row) {
+        for (row = 0; row < device->blockSize / number_per_row; ++row) {
             unsigned char *byte2 = byte;
             for (col = 0; col < number_per_row; ++col) {
                 printf("%02x ", *byte++);
@@ -188,4 +1174,5 @@ void displayBlock(int blockNumber) {
             printf("\n");
         }
     }
+    free(b);
 }
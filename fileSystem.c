@@ -7,7 +7,10 @@
  * Complete this file.
  */
 
+#include <endian.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,14 +18,42 @@
 #include "device.h"
 #include "fileSystem.h"
 
-#define UNALLOCATED 65534 // decimal value for an unallocated block in the file allocation table.
-#define END_OF_FILE 65535 // decimal value for EoF in the file allocation table.
+#define UNALLOCATED 0x7ffffffe // in-memory value for an unallocated block in the file allocation table.
+#define END_OF_FILE 0x7fffffff // in-memory value for EoF in the file allocation table.
+#define VOLUME_NAME_SIZE 64 // bytes of block 0 holding the volume name
 
-/* The file system error number. */
-int file_errno = 0;
+/* The file system error number, one per thread. */
+_Thread_local int file_errno = 0;
 
-/* Index for the block containing the root directory file */
-int root_block_idx = -1;
+/*
+ * On-disk layout, told apart by the identifier in block 1. 'WFS' stores FAT entries,
+ * start blocks, sizes and index slots in 16 bits, 'WF2' in 32 bits, both big endian base 256.
+ * 'WFL2' and 'WFL4' hold the same fields as little endian uint16_t/uint32_t, each at an
+ * offset that is a multiple of its size, so they can be loaded directly.
+ * Either way the two largest values of a FAT entry are the unallocated and end of file markers.
+ * Read from the device together with the root index, or set by format.
+ */
+struct Layout {
+    const char *id;     // identifier at the start of block 1
+    int fieldSize;      // bytes per FAT entry, start block, size and index slot
+    int rootSizeOffset; // position of the root directory size in block 1
+    int fatOffset;      // position of the FAT in block 1, after the identifier and the root size
+    int entrySize;      // bytes per directory entry: name (7), type (1), start block, size
+    uint32_t maxValue;  // largest value a field can hold
+    int littleEndian;   // 1 for the native layouts
+};
+
+#define MAX_ENTRY_SIZE 16 // largest directory entry of any layout
+
+/* Indexed by the FS_ values in fileSystem.h */
+struct Layout layouts[] = {
+    {"WFS", 2, 3, 5, 12, 0xffff, 0},
+    {"WF2", 4, 3, 7, 16, 0xffffffff, 0},
+    {"WFL2", 2, 4, 6, 12, 0xffff, 1},
+    {"WFL4", 4, 4, 8, 16, 0x7fffffff, 1}, // END_OF_FILE, so the markers match the in-memory ones
+};
+
+#define NUM_LAYOUTS (int)(sizeof(layouts) / sizeof(layouts[0]))
 
 struct BlockEntry {
     int idx;
@@ -32,17 +63,332 @@ struct BlockEntry {
 struct DirectoryEntry {
     int startBlockIdx;
     int filesize;
+    int entryOffset; // byte offset of the entry within its directory file
+};
+
+/*
+ * Position within a file's block chain, so reads can resume without walking from the start.
+ */
+struct BlockCursor {
+    int blockIdx;   // block holding file offset blockStart, -1 if unset
+    int blockStart; // file offset of the first byte in blockIdx
+};
+
+/*
+ * Result of resolving a full pathname.
+ */
+struct PathLookup {
+    struct DirectoryEntry entry; // the target, startBlockIdx -1 if it does not exist
+    int parentBlockIdx;          // start block of the directory holding the target
+    int parentLength;            // size of that directory file
+    unsigned char name[8];       // last section of the pathname
 };
 
-#define MAX_OPEN_FILES 1022 // Assignment brief only allows for max 1024 blocks. Each file/dir at least requires 1 block. Sys area takes up atleast 2.
 struct FilePointer {
     int startBlockIdx; // Serves as unique ID
     int offset;
+    struct BlockCursor cursor; // block reached by the previous read, so the next one resumes there
+};
+
+/*
+ * In-memory copy of the file allocation table.
+ * Loaded once per mount and written back to the device by _flushFAT().
+ */
+struct FatCache {
+    uint32_t *entries; // NULL until loaded
+    int dirtyLow;      // lowest modified entry since last flush (-1 if clean)
+    int dirtyHigh;     // highest modified entry since last flush
+};
+
+/*
+ * Free-space bitmap derived from the FAT at mount time.
+ * A set bit means the block is free. Blocks are claimed by clearing their bits with a compare
+ * and swap, without fatLock, and are linked into a chain in the FAT once their data is written.
+ * Until then a claimed block is still UNALLOCATED in the FAT.
+ */
+/*
+ * The map is split into allocation groups, runs of whole words searched next-fit from their
+ * own cursor. A file's blocks come from the group holding its directory, and growth stays in
+ * the group of the file's last block, so files written together don't interleave. New
+ * directories are spread over the groups by a hash of their name and parent.
+ * A full group spills into the ones after it.
+ */
+#define MAX_ALLOC_GROUPS 16
+#define MIN_GROUP_WORDS 4 // 256 blocks
+
+struct AllocGroup {
+    int firstWord;
+    int endWord;
+    int cursor; // next-fit: block to start the next search from
+};
+
+struct FreeMap {
+    uint64_t *words;
+    int nWords;
+    int freeCount; // number of set bits
+    struct AllocGroup groups[MAX_ALLOC_GROUPS];
+    int nGroups;
+    int groupWords;      // words in every group but the last, which takes the rest
+    unsigned generation; // changed each time the map is rebuilt
+};
+
+/*
+ * Blocks a thread has claimed ahead of time in each group of a mount, so most allocations
+ * touch no shared state. Refilled BLOCK_CACHE_BATCH at a time, next-fit from the group's
+ * cursor, so a thread appending on its own still gets consecutive blocks. Dropped if the
+ * free map is rebuilt, and handed back to it when the thread exits.
+ * A thread that finds the device full takes back the blocks in every other thread's cache,
+ * so each slot is emptied with an atomic exchange, by whichever thread gets to it first.
+ */
+#define BLOCK_CACHE_BATCH 16
+#define BLOCK_CACHE_LIMIT (2 * BLOCK_CACHE_BATCH) // blocks a thread keeps over all groups, a refill hands back the rest
+struct BlockCache {
+    int blocks[MAX_ALLOC_GROUPS][BLOCK_CACHE_BATCH]; // -1 once taken
+    int next[MAX_ALLOC_GROUPS]; // first slot of each group's batch not yet used, only the owner uses these
+    int count[MAX_ALLOC_GROUPS];
+    unsigned generation;     // of the free map the blocks were claimed from, set by the owner
+    struct wfs_mount *owner; // the mount the blocks belong to
+    struct BlockCache *link; // the owner's next cache
+};
+
+/*
+ * Ranges of freed blocks waiting for blockDiscard. They are sent once the FAT recording
+ * them as free has been written, so a crash can't leave a file with discarded blocks.
+ * A queued block that is allocated again is taken back out.
+ */
+#define DISCARD_QUEUE_SIZE 64
+struct DiscardRange {
+    int start;
+    int count;
+};
+
+struct DiscardQueue {
+    struct DiscardRange ranges[DISCARD_QUEUE_SIZE];
+    int count;
+};
+
+/*
+ * Remembers the tail block of recently appended files so appends don't walk the chain.
+ * Direct-mapped by start block. Block 0 is never a file start, so zeroed slots are empty.
+ * Entries are only trusted when the recorded length matches the caller's, and are
+ * rebuilt from the FAT on a miss (e.g. after a remount).
+ */
+#define TAIL_CACHE_SIZE 256
+struct TailCacheEntry {
+    int startBlockIdx;
+    int lastBlockIdx;
+    int length;
+};
+
+/*
+ * Dentry cache - maps (parent directory, name, type) to the entry found in that directory.
+ * Negative results (startBlockIdx -1) are cached too. Direct-mapped, so a colliding
+ * lookup simply replaces the slot. Kept exact by _createFile and _updateFilesize.
+ */
+#define DENTRY_CACHE_SIZE 512
+struct DentryCacheEntry {
+    int valid;
+    int parentBlockIdx;
+    unsigned char key[8]; // null padded name followed by the type
+    struct DirectoryEntry entry;
+};
+
+/*
+ * Directories with at least this many entries get a hashed index (see _indexNewEntry).
+ * Smaller directories keep the plain linear format.
+ */
+#define DIR_INDEX_THRESHOLD 64
+
+/*
+ * Aggregate size of each directory's subtree (its DMS plus everything below it), so list
+ * does not have to recurse. Built lazily and then kept up to date by create and the writes.
+ * Whenever a directory is in the table, so are all of its subdirectories.
+ * Open addressing keyed by start block - block 0 marks an empty slot.
+ * Changes to sizes are bracketed by _subtreeBegin and _subtreeEnd. A size added up while
+ * one was under way is not stored, as it may or may not include the change.
+ */
+struct SubtreeSize {
+    int dirBlockIdx;
+    int parentBlockIdx; // -1 for the root
+    int size;
+};
+
+struct SubtreeTable {
+    struct SubtreeSize *slots;
+    int capacity; // power of 2
+    int count;
+    int writers;    // changes under way
+    unsigned epoch; // changes finished
+};
+
+#define MAX_HANDLES 64
+/*
+ * An open file, resolved once by fsOpen so later calls skip the pathname and chain walks.
+ * position and cursor belong to the thread using the handle, the rest is guarded by handleLock.
+ */
+struct FileHandle {
+    int inUse;
+    int startBlockIdx;
+    int parentBlockIdx; // start block of the directory holding the file's entry
+    int entryOffset;    // position of the file's entry in that directory
+    unsigned char name[8];
+    int filesize;
+    int position;              // byte offset of the next read
+    struct BlockCursor cursor; // block reached by the last read
+};
+
+#define MAX_DIR_HANDLES 16
+#define DIR_BATCH_ENTRIES 16 // directory entries fetched per read
+/*
+ * An open directory iterator. Walks the directory chain through a block cursor,
+ * buffering a small batch of entries, so memory use does not depend on the directory size.
+ */
+struct DirHandle {
+    int inUse;
+    int dirBlockIdx;
+    int parentBlockIdx; // -1 for the root
+    int length;         // size of the directory file when it was opened
+    int position;       // offset of the next entry to return
+    struct BlockCursor cursor;
+    int batchStart; // offset of batch[0] in the directory, -1 if nothing is buffered
+    int batchLength;
+    unsigned char batch[DIR_BATCH_ENTRIES * MAX_ENTRY_SIZE];
+};
+
+/*
+ * Locking - the library can be called from many threads at once, except for format,
+ * formatLayout and convertLayout, which need the device to themselves.
+ *
+ * Every file and directory has a reader/writer lock, found by its start block. A file's lock
+ * covers its data and its chain in the FAT, a directory's covers its entries and its index.
+ * A size is changed with the locks of both the file and the directory holding its entry held
+ * for writing, so either one is enough to read it.
+ * Locks are taken in this order: one file's lock, then directory locks (a directory before its
+ * parent), then one of the cache mutexes above, then fatLock. Unrelated files in different
+ * directories can be written in parallel, meeting only in fatLock to link the blocks they claim.
+ */
+struct ChainLock {
+    int startBlockIdx;
+    int length; // a directory's size, -1 until known. Set by those reading its entry in its parent.
+    pthread_rwlock_t lock;
+    struct ChainLock *next;
+};
+
+#define CHAIN_LOCK_BUCKETS 256
+
+/*
+ * A mounted volume - a device and everything known about the file system on it.
+ * Every mount has its own caches and locks, so mounts driven by different threads share
+ * nothing. The calls in fileSystem.h use the calling thread's current mount, the default
+ * one on the configured device unless a _m call has chosen another.
+ */
+struct wfs_mount {
+    struct Device *device; // NULL for the default device
+
+    int root_block_idx;            // Index for the block containing the root directory file
+    pthread_mutex_t rootIndexLock; // Held while the layout and root index are read from the device.
+    struct Layout layout;
+    int rootSize; // Size of the root directory file, -1 until read from the device. Guarded by fatLock.
+
+    struct FatCache fatCache;
+    /*
+     * Guards fatCache and discardQueue, and block 1, where the FAT shares a block with the root size.
+     * Entries of a file's chain may be read without it by a thread holding the file's lock.
+     * Also guards the list of blockCaches.
+     */
+    pthread_mutex_t fatLock;
+    struct FreeMap freeMap;
+    pthread_key_t blockCacheKey;     // each thread's cache, its destructor returns an exiting thread's
+    struct BlockCache *blockCaches;  // every thread's, freed on unmount
+    struct DiscardQueue discardQueue;
+
+    struct TailCacheEntry tailCache[TAIL_CACHE_SIZE];
+    pthread_mutex_t tailLock;
+    struct DentryCacheEntry dentryCache[DENTRY_CACHE_SIZE];
+    pthread_mutex_t dentryLock;
+    struct SubtreeTable subtreeSizes;
+    pthread_mutex_t subtreeLock;
+
+    struct FilePointer *filePointers; // one per block, as every file takes up at least one
+    int nOpenFiles;                   // Number of open files
+    pthread_mutex_t filePointerLock;
+    struct FileHandle handles[MAX_HANDLES];
+    pthread_mutex_t handleLock; // also guards inUse of dirHandles
+    struct DirHandle dirHandles[MAX_DIR_HANDLES];
+
+    struct ChainLock *chainLocks[CHAIN_LOCK_BUCKETS]; // created on first use, freed when the device is reformatted or converted
+    pthread_mutex_t chainLocksLock;
+};
+
+struct wfs_mount defaultMount = {
+    .device = NULL,
+    .root_block_idx = -1,
+    .rootIndexLock = PTHREAD_MUTEX_INITIALIZER,
+    .layout = {"WFL2", 2, 4, 6, 12, 0xffff, 1},
+    .rootSize = -1,
+    .fatCache = {NULL, -1, -1},
+    .fatLock = PTHREAD_MUTEX_INITIALIZER,
+    .tailLock = PTHREAD_MUTEX_INITIALIZER,
+    .dentryLock = PTHREAD_MUTEX_INITIALIZER,
+    .subtreeLock = PTHREAD_MUTEX_INITIALIZER,
+    .filePointerLock = PTHREAD_MUTEX_INITIALIZER,
+    .handleLock = PTHREAD_MUTEX_INITIALIZER,
+    .chainLocksLock = PTHREAD_MUTEX_INITIALIZER,
 };
 
-// Global file pointer list
-struct FilePointer filePointers[MAX_OPEN_FILES * sizeof(struct FilePointer)];
-int nOpenFiles = 0; // Number of open files
+/* The default mount's blockCacheKey, made when first needed. */
+pthread_once_t defaultCacheKeyOnce = PTHREAD_ONCE_INIT;
+
+/* The calling thread's current mount. */
+_Thread_local struct wfs_mount *mount = &defaultMount;
+
+/**
+ * @brief Finds the layout whose identifier starts block 1.
+ *
+ * @return FS_ value of the layout, -1 if the device is not formatted.
+ */
+int _matchLayout(const unsigned char *header) {
+    for (int i = 0; i < NUM_LAYOUTS; i++) {
+        if (memcmp(header, layouts[i].id, strlen(layouts[i].id)) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Picks the layout named by the identifier in block 1. Unformatted devices get the default one.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int _loadLayout() {
+    const unsigned char *header = blockPin(1);
+    if (header == NULL) {
+        file_errno = EBADDEV;
+        printDevError("device err");
+        return -1;
+    }
+
+    int match = _matchLayout(header);
+    mount->layout = layouts[(match < 0) ? FS_WFL2 : match];
+    blockUnpin(header);
+    return 0;
+}
+
+/**
+ * @brief Number of blocks before the root directory (block 0 and the FAT) for a layout.
+ */
+int _layoutReservedBlocks(const struct Layout *layout) {
+    return 1 + ((layout->fatOffset + numBlocks() * layout->fieldSize + (blockSize() - 1)) / blockSize()); // always round up
+}
+
+/**
+ * @brief Number of blocks before the root directory (block 0 and the FAT) for the current layout.
+ */
+int _reservedBlocks() {
+    return _layoutReservedBlocks(&mount->layout);
+}
 
 /**
  * @brief Gets the Root Index
@@ -50,20 +396,24 @@ int nOpenFiles = 0; // Number of open files
  * @return int
  */
 int getRootIndex() {
-    if (root_block_idx == -1) {
-        root_block_idx = 1 + ((5 + numBlocks() * 2 + (BLOCK_SIZE - 1)) / BLOCK_SIZE);
+    int rootIndex = __atomic_load_n(&mount->root_block_idx, __ATOMIC_ACQUIRE);
+    if (rootIndex == -1) {
+        pthread_mutex_lock(&mount->rootIndexLock);
+        if (mount->root_block_idx == -1) {
+            _loadLayout();
+            __atomic_store_n(&mount->root_block_idx, _reservedBlocks(), __ATOMIC_RELEASE);
+        }
+        rootIndex = mount->root_block_idx;
+        pthread_mutex_unlock(&mount->rootIndexLock);
     }
 
-    return root_block_idx;
+    return rootIndex;
 }
 
 void resetBlocks() {
     // printf("\n = CLEARING BLOCKS = \n");
-    unsigned char buffer[BLOCK_SIZE] = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
-    // unsigned char buffer[BLOCK_SIZE] = "OOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOO";
-    for (int i = 0; i < numBlocks(); i++) {
-        blockWrite(i, buffer);
-    }
+    // Released rather than written where the device allows it, so this stays cheap on large devices
+    blockZeroRange(0, numBlocks());
 }
 
 /**
@@ -76,1116 +426,3672 @@ void resetBlocks() {
  * @return int
  */
 int isFormatted() {
-    unsigned char data[BLOCK_SIZE];
-
-    if (blockRead(1, data) == -1) {
+    const unsigned char *data = blockPin(1);
+    if (data == NULL) {
         file_errno = EBADDEV;
         printDevError("device err");
         return -1;
     }
 
-    return (data[0] == 'W') && (data[1] == 'F') && (data[2] == 'S');
+    int formatted = _matchLayout(data) >= 0;
+    blockUnpin(data);
+    return formatted;
+}
+
+/**
+ * @brief Reads a field of the given layout, without any range check.
+ */
+uint32_t _getRawAs(const struct Layout *l, const unsigned char *field) {
+    if (l->littleEndian) {
+        if (l->fieldSize == 2) {
+            uint16_t value;
+            memcpy(&value, field, 2);
+            return le16toh(value);
+        }
+        uint32_t value;
+        memcpy(&value, field, 4);
+        return le32toh(value);
+    }
+
+    uint32_t result = 0;
+    for (int i = 0; i < l->fieldSize; i++) {
+        result = (result << 8) | field[i];
+    }
+
+    return result;
+}
+
+/**
+ * @brief Writes a field of the given layout. The value must fit.
+ */
+void _putRawAs(const struct Layout *l, unsigned char *field, uint32_t n) {
+    if (l->littleEndian) {
+        if (l->fieldSize == 2) {
+            uint16_t value = htole16((uint16_t)n);
+            memcpy(field, &value, 2);
+        } else {
+            uint32_t value = htole32(n);
+            memcpy(field, &value, 4);
+        }
+        return;
+    }
+
+    for (int i = l->fieldSize - 1; i >= 0; i--) {
+        field[i] = n & 0xff;
+        n >>= 8;
+    }
+}
+
+uint32_t _getRaw(const unsigned char *field) {
+    return _getRawAs(&mount->layout, field);
+}
+
+void _putRaw(unsigned char *field, uint32_t n) {
+    _putRawAs(&mount->layout, field, n);
 }
 
 /**
- * @brief decodes the given characters from the base256 storage format.
- * NOTE: valid literal values range from 1 to 65535 (mapping to 0 to 65534) since 00000000 is the NULL terminator.
+ * @brief decodes a field (2 bytes for 'WFS'/'WFL2', 4 for 'WF2'/'WFL4') from its storage format.
  *
+ * @param field first (most significant) byte of the field
  * @return decoded integer or -1 if error.
  */
-int _getDecoded(unsigned char c1, unsigned char c0) {
-    int result = (unsigned char)c1 * 256 + (unsigned char)c0;
+int _getDecoded(const unsigned char *field) {
+    uint32_t result = _getRaw(field);
 
-    if (result < 0 || result > 65535) {
+    if (result > INT32_MAX) {
         file_errno = EOTHER;
         return -1;
     }
 
-    return result;
+    return (int)result;
 }
 
 /**
- * @brief encodes the given integer in range 0 -> 65535 to characters in the base 256 storage format.
+ * @brief encodes the given integer to a field in the layout's storage format.
  *
- * @param n integer to convert
- * @param result pointer to an  char array of length 2
+ * @param n integer to convert, 0 -> 65535 for the 16 bit layouts
+ * @param result first byte of the field, 2 or 4 bytes long
  *
  * @return 0 if successful, -1 if error.
  */
 int _encode(int n, unsigned char *result) {
-    if (n < 0 || n > 65535) {
+    if (n < 0 || (uint32_t)n > mount->layout.maxValue) {
         file_errno = EOTHER;
         return -1;
     }
 
-    result[0] = (n % 256);
-    result[1] = (int)((n - (n % 256)) / 256);
+    _putRaw(result, (uint32_t)n);
 
     return 0;
 }
 
-int _getRootSize() {
+/**
+ * @brief Largest size a file or directory can reach in the current layout.
+ */
+int _maxFilesize() {
+    return (mount->layout.maxValue > INT32_MAX) ? INT32_MAX : (int)mount->layout.maxValue;
+}
+
+/**
+ * @brief Start block field of a directory entry.
+ */
+int _entryStartBlock(const unsigned char *entry) {
+    return _getDecoded(entry + 8);
+}
+
+/**
+ * @brief Filesize field of a directory entry.
+ */
+int _entryFilesize(const unsigned char *entry) {
+    return _getDecoded(entry + 8 + mount->layout.fieldSize);
+}
+
+int _getRootSizeLocked() {
+    if (mount->rootSize >= 0) {
+        return mount->rootSize;
+    }
+
     if (isFormatted() != 1) {
         file_errno = EOTHER;
         return -5;
     }
 
-    unsigned char buffer[BLOCK_SIZE];
-    if (blockRead(1, buffer) == -1) {
+    const unsigned char *header = blockPin(1);
+    if (header == NULL) {
         file_errno = EBADDEV;
         printDevError("device err");
         return -2;
     }
-    return _getDecoded(buffer[3], buffer[4]);
+    mount->rootSize = _getDecoded(header + mount->layout.rootSizeOffset);
+    blockUnpin(header);
+    return mount->rootSize;
 }
 
-int _setRootSize(int size) {
-    unsigned char buffer[BLOCK_SIZE];
-    if (blockRead(1, buffer) == -1) {
+int _getRootSize() {
+    pthread_mutex_lock(&mount->fatLock);
+    int size = _getRootSizeLocked();
+    pthread_mutex_unlock(&mount->fatLock);
+    return size;
+}
+
+int _setRootSizeLocked(int size) {
+    unsigned char *header = blockPinMut(1);
+    if (header == NULL) {
         file_errno = EBADDEV;
         printDevError("device err");
         return -1;
     }
 
-    unsigned char encoded[2];
-    _encode(size, encoded);
-
-    buffer[3] = encoded[1];
-    buffer[4] = encoded[0];
-
-    if (blockWrite(1, buffer)) {
+    if (_encode(size, header + mount->layout.rootSizeOffset) != 0) {
+        blockUnpin(header);
+        return -1;
+    }
+    if (blockUnpin(header)) {
         file_errno = EBADDEV;
         printDevError("device err");
         return -1;
     }
 
+    mount->rootSize = size;
     return 0;
 }
 
-int _loadFAT(unsigned char *fat) {
-    fat[0] = '\0';
+int _setRootSize(int size) {
+    pthread_mutex_lock(&mount->fatLock);
+    int result = _setRootSizeLocked(size);
+    pthread_mutex_unlock(&mount->fatLock);
+    return result;
+}
 
-    // Read FAT
-    int fatLength = 5 + numBlocks() * 2;
-    int remainingLength = fatLength;
-    while (remainingLength > 0) {
-        // Read block
-        unsigned char readBuffer[BLOCK_SIZE] = {'\0'};
-        if (blockRead(1, readBuffer) == -1) {
-            file_errno = EBADDEV;
-            printDevError("device err");
-            return -1;
-        }
+/**
+ * @brief Byte position of a FAT entry relative to the start of block 1.
+ */
+int _fatEntryPos(int block) {
+    return mount->layout.fatOffset + mount->layout.fieldSize * block;
+}
 
-        // Get rid of FS header & root size
-        if (remainingLength == fatLength) {
-            if (remainingLength > BLOCK_SIZE) {
-                memcpy((char *)fat, (char *)(readBuffer + 4), BLOCK_SIZE - 5);
-                remainingLength -= BLOCK_SIZE;
-            } else {
-                memcpy((char *)fat, (char *)(readBuffer + 4), remainingLength - 5);
-                remainingLength -= remainingLength;
-            }
-        }
+/**
+ * @brief Rebuilds freeMap from the entries in fatCache.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int _buildFreeMap() {
+    free(mount->freeMap.words);
+    mount->freeMap.nWords = (numBlocks() + 63) / 64;
+    mount->freeMap.words = calloc(mount->freeMap.nWords, sizeof(uint64_t));
+    if (mount->freeMap.words == NULL) {
+        file_errno = EOTHER;
+        return -1;
+    }
 
-        // Do others normally.
-        if (remainingLength > BLOCK_SIZE) {
-            memcpy((char *)fat, (char *)readBuffer, BLOCK_SIZE);
-            remainingLength -= BLOCK_SIZE;
-        } else {
-            memcpy((char *)fat, (char *)readBuffer, remainingLength);
-            remainingLength -= remainingLength;
+    for (int i = 0; i < numBlocks(); i++) {
+        if (mount->fatCache.entries[i] == UNALLOCATED) {
+            mount->freeMap.words[i / 64] |= (uint64_t)1 << (i % 64);
         }
     }
 
+    mount->freeMap.freeCount = 0;
+    for (int w = 0; w < mount->freeMap.nWords; w++) {
+        mount->freeMap.freeCount += __builtin_popcountll(mount->freeMap.words[w]);
+    }
+
+    mount->freeMap.nGroups = mount->freeMap.nWords / MIN_GROUP_WORDS;
+    if (mount->freeMap.nGroups < 1) {
+        mount->freeMap.nGroups = 1;
+    } else if (mount->freeMap.nGroups > MAX_ALLOC_GROUPS) {
+        mount->freeMap.nGroups = MAX_ALLOC_GROUPS;
+    }
+    mount->freeMap.groupWords = mount->freeMap.nWords / mount->freeMap.nGroups;
+    for (int g = 0; g < mount->freeMap.nGroups; g++) {
+        struct AllocGroup *group = &mount->freeMap.groups[g];
+        group->firstWord = g * mount->freeMap.groupWords;
+        group->endWord = (g == mount->freeMap.nGroups - 1) ? mount->freeMap.nWords : group->firstWord + mount->freeMap.groupWords;
+        group->cursor = group->firstWord * 64;
+    }
+    mount->freeMap.groups[0].cursor = getRootIndex();
+    mount->freeMap.generation++;
     return 0;
 }
 
-struct BlockEntry getBlockEntry(int block) {
-    struct BlockEntry entry = {-1, -1};
-    unsigned char c1, c0;
-
-    int c1_block = (5 + 2 * (block)) / BLOCK_SIZE + 1;
-    int c1_offset = (5 + 2 * (block)) % BLOCK_SIZE;
-
-    int c0_block = (6 + 2 * (block)) / BLOCK_SIZE + 1;
-    int c0_offset = (6 + 2 * (block)) % BLOCK_SIZE;
-
-    // Read C1
-    unsigned char readBuffer[BLOCK_SIZE];
-    if (blockRead(c1_block, readBuffer) == -1) {
-        file_errno = EBADDEV;
-        printDevError("device err");
-        return entry;
+/**
+ * @brief The allocation group a block belongs to, 0 before the free map is built.
+ */
+int _groupOf(int block) {
+    if (mount->freeMap.groupWords == 0) {
+        return 0;
     }
-    c1 = readBuffer[c1_offset];
+    int group = block / 64 / mount->freeMap.groupWords;
+    return (group < mount->freeMap.nGroups) ? group : mount->freeMap.nGroups - 1;
+}
 
-    if (c1_block == c0_block) {
-        c0 = readBuffer[c0_offset];
-    } else {
-        // Read c0
-        if (blockRead(c0_block, readBuffer) == -1) {
-            file_errno = EBADDEV;
-            printDevError("device err");
-            return entry;
-        }
-        c0 = readBuffer[c0_offset];
+/**
+ * @brief Claims a block if it is free.
+ *
+ * @return int 1 if this call claimed it, 0 if it was not free.
+ */
+int _claimBlock(int block) {
+    uint64_t bit = (uint64_t)1 << (block % 64);
+    if ((__atomic_fetch_and(&mount->freeMap.words[block / 64], ~bit, __ATOMIC_ACQ_REL) & bit) == 0) {
+        return 0;
     }
-
-    entry.idx = block;
-    entry.value = _getDecoded(c1, c0);
-
-    return entry;
+    __atomic_fetch_sub(&mount->freeMap.freeCount, 1, __ATOMIC_RELAXED);
+    return 1;
 }
 
-int setBlockEntry(struct BlockEntry entry) {
-    // Determine block to change
-    int c1_block = (5 + 2 * (entry.idx)) / BLOCK_SIZE + 1;
-    int c1_offset = (5 + 2 * (entry.idx)) % BLOCK_SIZE;
+/**
+ * @brief Returns a claimed or freed block to the free map.
+ */
+void _releaseBlock(int block) {
+    __atomic_fetch_or(&mount->freeMap.words[block / 64], (uint64_t)1 << (block % 64), __ATOMIC_ACQ_REL);
+    __atomic_fetch_add(&mount->freeMap.freeCount, 1, __ATOMIC_RELAXED);
+}
 
-    int c0_block = (6 + 2 * (entry.idx)) / BLOCK_SIZE + 1;
-    int c0_offset = (6 + 2 * (entry.idx)) % BLOCK_SIZE;
+void _releaseBlocks(int *blocks, int count) {
+    for (int i = 0; i < count; i++) {
+        _releaseBlock(blocks[i]);
+    }
+}
 
-    unsigned char encoded[2];
-    _encode(entry.value, encoded);
+/**
+ * @brief Claims up to count of the free blocks of bitmap word w at or above fromBit, lowest first,
+ * with one compare and swap.
+ *
+ * @return int number of blocks claimed, written to blocks.
+ */
+int _claimFromWord(int w, int fromBit, int count, int *blocks) {
+    uint64_t *word = &mount->freeMap.words[w];
+    uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+    while (1) {
+        uint64_t available = old & (~(uint64_t)0 << fromBit);
+        uint64_t take = 0;
+        int n = 0;
+        for (; available != 0 && n < count; n++) {
+            take |= available & -available;
+            available &= available - 1;
+        }
+        if (n == 0) {
+            return 0;
+        }
 
-    // Modify C1
-    unsigned char readBuffer[BLOCK_SIZE];
-    if (blockRead(c1_block, readBuffer) == -1) {
-        file_errno = EBADDEV;
-        printDevError("device err");
-        return -1;
+        // On failure old is reloaded, try again with what is left
+        if (__atomic_compare_exchange_n(word, &old, old & ~take, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            for (int i = 0; i < n; i++) {
+                blocks[i] = w * 64 + __builtin_ctzll(take);
+                take &= take - 1;
+            }
+            __atomic_fetch_sub(&mount->freeMap.freeCount, n, __ATOMIC_RELAXED);
+            return n;
+        }
     }
-    readBuffer[c1_offset] = encoded[1];
+}
 
-    // Maybe modify c0 as well.
-    if (c1_block == c0_block) {
-        readBuffer[c0_offset] = encoded[0];
+/**
+ * @brief Claims up to count free blocks of one group, next-fit from its cursor, wrapping around the group.
+ *
+ * @return int number of blocks claimed, 0 if the group is full.
+ */
+int _claimGroupBlocks(struct AllocGroup *group, int count, int *blocks) {
+    int nWords = group->endWord - group->firstWord;
+    int cursor = __atomic_load_n(&group->cursor, __ATOMIC_RELAXED);
+    int w = cursor / 64;
+    int fromBit = cursor % 64;
+    int claimed = 0;
+
+    // nWords + 1 steps revisits the first word, covering the bits below the cursor.
+    for (int step = 0; step <= nWords && claimed < count; step++) {
+        claimed += _claimFromWord(w, fromBit, count - claimed, blocks + claimed);
+        w = (w + 1 == group->endWord) ? group->firstWord : w + 1;
+        fromBit = 0;
     }
 
-    // Write C1
-    if (blockWrite(c1_block, readBuffer)) {
-        file_errno = EBADDEV;
-        printDevError("device err");
-        return -1;
+    if (claimed > 0) {
+        int next = blocks[claimed - 1] + 1;
+        __atomic_store_n(&group->cursor, (next < group->endWord * 64) ? next : group->firstWord * 64, __ATOMIC_RELAXED);
     }
+    return claimed;
+}
 
-    // Modify and write c0
-    if (c1_block != c0_block) {
-        if (blockRead(c0_block, readBuffer) == -1) {
-            file_errno = EBADDEV;
-            printDevError("device err");
-            return -1;
-        }
-        readBuffer[c0_offset] = encoded[0];
-        if (blockWrite(c0_block, readBuffer)) {
-            file_errno = EBADDEV;
-            printDevError("device err");
-            return -1;
+/**
+ * @brief Claims up to count free blocks from a group, or from the groups after it once it is full.
+ *
+ * @return int number of blocks claimed, 0 if the device is full.
+ */
+int _claimFreeBlocks(int group, int count, int *blocks) {
+    for (int i = 0; i < mount->freeMap.nGroups; i++) {
+        int claimed = _claimGroupBlocks(&mount->freeMap.groups[(group + i) % mount->freeMap.nGroups], count, blocks);
+        if (claimed > 0) {
+            return claimed;
         }
     }
-
     return 0;
 }
 
 /**
- * @brief After a device restart, file pointers (which are memory constructs) are lost. We must regenerate a file pointer list everytime it is restarted (with offsets reset back to 0).
+ * @brief Takes the blocks out of a cache, handing them back to the free map if they are from it.
  *
+ * @param release whether the blocks are from the current free map.
+ * @return int number of blocks handed back.
  */
-void regenerateFilePointers() {
-    // printf("Regenerating file pointers\n");
-    unsigned char *fat = malloc(2 * numBlocks() + 1);
-    if (_loadFAT(fat) != 0) {
-        file_errno = EOTHER;
-        free(fat);
-        return;
+int _drainBlockCache(struct BlockCache *cache, int release) {
+    int drained = 0;
+    for (int g = 0; g < MAX_ALLOC_GROUPS; g++) {
+        for (int i = 0; i < BLOCK_CACHE_BATCH; i++) {
+            int idx = __atomic_exchange_n(&cache->blocks[g][i], -1, __ATOMIC_ACQ_REL);
+            if (idx >= 0 && release) {
+                _releaseBlock(idx);
+                drained++;
+            }
+        }
     }
+    return drained;
+}
 
-    int *visited = calloc(numBlocks(), sizeof(int)); // visited array of blocks
+/**
+ * @brief Forgets the blocks in a cache, by its owner, which are handed back first if still from the current free map.
+ */
+void _emptyBlockCache(struct BlockCache *cache) {
+    _drainBlockCache(cache, cache->generation == __atomic_load_n(&mount->freeMap.generation, __ATOMIC_RELAXED));
+    memset(cache->next, 0, sizeof(cache->next));
+    memset(cache->count, 0, sizeof(cache->count));
+}
 
-    for (int i = getRootIndex(); i < numBlocks(); i++) {
-        int candidateStartIdx = i;
-        struct BlockEntry entry = getBlockEntry(i);
-        if (entry.value != UNALLOCATED && visited[i] != 1) {
-            visited[i] = 1;
+/**
+ * @brief Hands the blocks left in an exiting thread's cache back to its mount and frees it.
+ */
+void _returnBlockCache(void *data) {
+    struct BlockCache *cache = data;
+    struct wfs_mount *previous = mount;
+    mount = cache->owner;
+    _emptyBlockCache(cache);
+
+    pthread_mutex_lock(&mount->fatLock);
+    struct BlockCache **link = &mount->blockCaches;
+    while (*link != cache) {
+        link = &(*link)->link;
+    }
+    *link = cache->link;
+    pthread_mutex_unlock(&mount->fatLock);
 
-            int iterationDepth = 0;
-            // traverse linked list
-            while (entry.value != END_OF_FILE) {
-                visited[entry.value] = 1;
-                entry = getBlockEntry(entry.value);
-                iterationDepth++;
+    free(cache);
+    mount = previous;
+}
 
-                if (iterationDepth > numBlocks()) {
-                    printf("ERROR: Detected loop while regenerating file pointers. May indicate malformed file allocation table.");
-                    file_errno = EOTHER;
-                    free(visited);
-                    free(fat);
-                    return;
-                }
-            }
+void _createDefaultCacheKey() {
+    pthread_key_create(&defaultMount.blockCacheKey, _returnBlockCache);
+}
 
-            // Recovery file pointers
-            filePointers[nOpenFiles].startBlockIdx = candidateStartIdx;
-            filePointers[nOpenFiles].offset = 0;
-            nOpenFiles++;
-        }
+/**
+ * @brief The calling thread's block cache for the current mount, made on first use.
+ *
+ * @return struct BlockCache* the cache, NULL if it can't be made.
+ */
+struct BlockCache *_blockCache() {
+    if (mount == &defaultMount) {
+        pthread_once(&defaultCacheKeyOnce, _createDefaultCacheKey);
+    }
+    struct BlockCache *cache = pthread_getspecific(mount->blockCacheKey);
+    if (cache != NULL) {
+        return cache;
     }
 
-    free(visited);
-    free(fat);
+    cache = calloc(1, sizeof(struct BlockCache));
+    if (cache == NULL) {
+        file_errno = EOTHER;
+        return NULL;
+    }
+    memset(cache->blocks, 0xff, sizeof(cache->blocks));
+    cache->generation = mount->freeMap.generation;
+    cache->owner = mount;
+    pthread_mutex_lock(&mount->fatLock);
+    cache->link = mount->blockCaches;
+    mount->blockCaches = cache;
+    pthread_mutex_unlock(&mount->fatLock);
+    pthread_setspecific(mount->blockCacheKey, cache);
+    return cache;
 }
 
-/*
- * Formats the device for use by this file system.
- * The volume name must be < 64 bytes long.
- * All information previously on the device is lost.
- * Also creates the root directory "/".
- * Returns 0 if no problem or -1 if the call failed.
+/**
+ * @brief Takes a block from the thread's cache for a group, refilling it when empty. The refill
+ * hands back the other groups' batches when the thread would hold more than BLOCK_CACHE_LIMIT.
+ * If the device is full, blocks cached for the other groups are used up before giving up.
+ *
+ * @return int block index, or -1 if the device is full.
  */
-int format(char *volumeName) {
-    resetBlocks(); // Optional - useful for testing.
-
-    // Clear file pointers
-    memset(filePointers, 0, sizeof(filePointers));
-    nOpenFiles = 0;
+int _takeCachedBlock(struct BlockCache *cache, int group) {
+    if (cache->next[group] == cache->count[group]) {
+        // Only a thread moving on from the groups it was writing in holds other batches beyond the limit
+        int held = 0;
+        for (int g = 0; g < MAX_ALLOC_GROUPS; g++) {
+            held += cache->count[g] - cache->next[g];
+        }
+        if (held > BLOCK_CACHE_LIMIT - BLOCK_CACHE_BATCH) {
+            for (int g = 0; g < MAX_ALLOC_GROUPS; g++) {
+                for (; cache->next[g] < cache->count[g]; cache->next[g]++) {
+                    int idx = __atomic_exchange_n(&cache->blocks[g][cache->next[g]], -1, __ATOMIC_ACQ_REL);
+                    if (idx >= 0) {
+                        _releaseBlock(idx);
+                    }
+                }
+            }
+        }
 
-    // Check block number validity
-    int reserved_blocks = 1 + ((5 + numBlocks() * 2 + (BLOCK_SIZE - 1)) / BLOCK_SIZE); // always round up
-    if ((numBlocks() - reserved_blocks) < 0) {
-        file_errno = ENOROOM;
-        return -1;
+        int batch[BLOCK_CACHE_BATCH];
+        cache->next[group] = 0;
+        cache->count[group] = _claimFreeBlocks(group, BLOCK_CACHE_BATCH, batch);
+        for (int i = 0; i < cache->count[group]; i++) {
+            __atomic_store_n(&cache->blocks[group][i], batch[i], __ATOMIC_RELEASE);
+        }
     }
-
-    // Check volume name validiity
-    if (strlen(volumeName) > (BLOCK_SIZE - 1)) {
-        file_errno = EBADVOLNAME;
-        return -1;
+    for (int i = 0; i < mount->freeMap.nGroups; i++) {
+        int g = (group + i) % mount->freeMap.nGroups;
+        while (cache->next[g] < cache->count[g]) {
+            int idx = __atomic_exchange_n(&cache->blocks[g][cache->next[g]++], -1, __ATOMIC_ACQ_REL);
+            if (idx >= 0) {
+                return idx;
+            }
+        }
     }
+    return -1;
+}
 
-    // Set volume name to first block
-    unsigned char buffer[BLOCK_SIZE];
-    strncpy((char *)buffer, volumeName, BLOCK_SIZE);
-
-    if (blockWrite(0, buffer) == -1) {
-        file_errno = EBADDEV;
-        printDevError("device err");
-        return -1;
+/**
+ * @brief Hands the blocks cached by every thread back to the free map, for a thread that found it empty.
+ * Caches still holding blocks from before the map was rebuilt are left to their owners.
+ *
+ * @return int number of blocks handed back.
+ */
+int _reclaimCachedBlocks() {
+    unsigned generation = __atomic_load_n(&mount->freeMap.generation, __ATOMIC_RELAXED);
+    int reclaimed = 0;
+    pthread_mutex_lock(&mount->fatLock);
+    for (struct BlockCache *cache = mount->blockCaches; cache != NULL; cache = cache->link) {
+        if (__atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE) == generation) {
+            reclaimed += _drainBlockCache(cache, 1);
+        }
     }
+    pthread_mutex_unlock(&mount->fatLock);
+    return reclaimed;
+}
 
-    // Assign WFS header (used to quickly check if a device has been formatted before)
-    buffer[0] = 'W';
-    buffer[1] = 'F';
-    buffer[2] = 'S';
-
-    // Initialise root directory size to 0
-    buffer[3] = (unsigned char)0;
-    buffer[4] = (unsigned char)0;
-
-    if (blockWrite(1, buffer) == -1) {
-        file_errno = EBADDEV;
+/**
+ * @brief Claims count blocks to extend a chain whose last block is lastBlockIdx.
+ * The block straight after the previous one is taken when free, so runs stay contiguous on the device,
+ * the others come from the thread's cache for the chain's group. Once the free map and the cache are empty, the
+ * blocks other threads have cached are taken back before giving up. Either all blocks are claimed or none are.
+ * The blocks stay unlinked until passed to _linkBlocks, or back in the free map with _releaseBlocks.
+ *
+ * @param group allocation group of a new chain, ignored when extending one (which stays in its last block's group).
+ * @param lastBlockIdx current tail block of the chain, or -1 to start a new chain.
+ * @return int 0 for success, -1 for error.
+ */
+int _claimBlocks(int group, int lastBlockIdx, int count, int *blocks) {
+    struct BlockCache *cache = _blockCache();
+    if (cache == NULL) {
         return -1;
     }
+    if (cache->generation != __atomic_load_n(&mount->freeMap.generation, __ATOMIC_RELAXED)) {
+        _emptyBlockCache(cache);
+        __atomic_store_n(&cache->generation, mount->freeMap.generation, __ATOMIC_RELEASE);
+    }
+    if (lastBlockIdx >= 0) {
+        group = _groupOf(lastBlockIdx);
+    }
 
-    /**
-     * Create FAT - every 2 characters represents both an 'allocated' flag and the next block value in linked list.
-     *
-     * ==============
-     *    ENCODING
-     * --------------
-     * ALL VALUES INCLUSIVE.
-     *
-     * 0-65533     : 0-65533 : NEXT BLOCK INDEX
-     * 65534       :  65534  : UNALLOCATED BLOCK
-     * 65535       :  65535  : END OF FILE
-     * ==============
-     */
-    for (int i = 0; i < numBlocks(); i++) {
-        struct BlockEntry entry = {i, UNALLOCATED};
-
-        // Set to allocated if it is a reserved block or the root (i.e. last reserved block idx + 1).
-        if (i <= reserved_blocks) {
-            entry.value = END_OF_FILE;
+    int prev = lastBlockIdx;
+    for (int i = 0; i < count; i++) {
+        int idx = prev + 1;
+        if (prev < 0 || idx >= numBlocks() || !_claimBlock(idx)) {
+            idx = _takeCachedBlock(cache, group);
+            while (idx < 0 && _reclaimCachedBlocks() > 0) {
+                idx = _takeCachedBlock(cache, group);
+            }
+            if (idx < 0) {
+                _releaseBlocks(blocks, i);
+                file_errno = ENOROOM;
+                printDevError("NO ROOM\n");
+                return -1;
+            }
         }
-
-        setBlockEntry(entry);
+        blocks[i] = idx;
+        prev = idx;
     }
+    return 0;
+}
 
+/**
+ * @brief Whether the on-disk FAT is byte for byte the in-memory one ('WFL4' on a little endian host).
+ */
+int _fatIsNative() {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return mount->layout.littleEndian && mount->layout.fieldSize == sizeof(uint32_t);
+#else
     return 0;
+#endif
 }
 
-/*
- * Returns the volume's name in the result.
- * Returns 0 if no problem or -1 if the call failed.
+/**
+ * @brief Loads the file allocation table into fatCache (if not already loaded), with fatLock held.
+ * The system area is read with one pass over its blocks and decoded into native integers.
+ *
+ * @return int 0 for success, -1 for error.
  */
-int volumeName(char *result) {
-    if (isFormatted() != 1) {
+int _loadFATLocked() {
+    if (mount->fatCache.entries != NULL) {
+        return 0;
+    }
+
+    uint32_t *entries = malloc(numBlocks() * sizeof(uint32_t));
+    if (entries == NULL) {
         file_errno = EOTHER;
         return -1;
     }
 
-    if (blockRead(0, (unsigned char *)result) == -1) {
+    // Decode straight from the device, the FAT blocks are contiguous
+    const unsigned char *raw = blockSpan(1, getRootIndex() - 1);
+    if (raw == NULL) {
         file_errno = EBADDEV;
         printDevError("device err");
+        free(entries);
         return -1;
     }
+    if (_fatIsNative()) {
+        memcpy(entries, raw + mount->layout.fatOffset, numBlocks() * sizeof(uint32_t));
+    }
 
-    return 0;
-}
-
-int _min(int n0, int n1) {
-    if (n0 < n1) {
-        return n0;
-    } else {
-        return n1;
+    // The two largest values of the layout are the markers
+    for (int i = 0; i < numBlocks() && !_fatIsNative(); i++) {
+        uint32_t value = _getRaw(raw + _fatEntryPos(i));
+        if (value == mount->layout.maxValue) {
+            value = END_OF_FILE;
+        } else if (value == mount->layout.maxValue - 1) {
+            value = UNALLOCATED;
+        }
+        entries[i] = value;
     }
+    blockUnpin(raw);
+
+    mount->fatCache.dirtyLow = -1;
+    mount->fatCache.dirtyHigh = -1;
+    __atomic_store_n(&mount->fatCache.entries, entries, __ATOMIC_RELEASE);
+    return _buildFreeMap();
 }
 
 /**
- * @brief Reads a specified amount of data starting at the specified block.
+ * @brief Loads the file allocation table into fatCache (if not already loaded).
  *
- * @param startBlockIdx
- * @param length amount of characters to read (excl. null terminator)
- * @param result
  * @return int 0 for success, -1 for error.
  */
-int _read(int startBlockIdx, int length, int offset, unsigned char *result) {
-    result[0] = '\0';
+int _loadFAT() {
+    if (__atomic_load_n(&mount->fatCache.entries, __ATOMIC_ACQUIRE) != NULL) {
+        return 0;
+    }
 
-    int remainingLength = length;
-    int remainingOffset = offset;
-    int blockIdx = startBlockIdx;
+    pthread_mutex_lock(&mount->fatLock);
+    int result = _loadFATLocked();
+    pthread_mutex_unlock(&mount->fatLock);
+    return result;
+}
 
-    do {
-        // Read block
-        unsigned char readBuffer[BLOCK_SIZE] = {'\0'};
-        if (blockRead(blockIdx, readBuffer) == -1) {
-            file_errno = EBADDEV;
-            printDevError("device err");
-            return -1;
+/**
+ * @brief Re-encodes every cached FAT entry with at least one byte in FAT block b into its data.
+ */
+void _encodeFATBlock(int b, unsigned char *buffer) {
+    int blockStart = (b - 1) * blockSize();
+    if (_fatIsNative()) {
+        // Aligned entries never straddle blocks, copy the ones in this block as they are
+        int first = (blockStart < mount->layout.fatOffset) ? 0 : (blockStart - mount->layout.fatOffset) / mount->layout.fieldSize;
+        int end = (blockStart + blockSize() - mount->layout.fatOffset) / mount->layout.fieldSize;
+        if (end > numBlocks()) {
+            end = numBlocks();
         }
-
-        if (remainingOffset > BLOCK_SIZE) {
-            // Offset by whole block
-            remainingOffset -= BLOCK_SIZE;
-        } else {
-            // Copy block with partial or no offset
-            memcpy((char *)result + (length - remainingLength), (char *)readBuffer + remainingOffset, _min(BLOCK_SIZE - remainingOffset, remainingLength));
-            remainingLength -= _min(BLOCK_SIZE - remainingOffset, remainingLength);
-            remainingOffset -= remainingOffset;
+        if (end > first) {
+            memcpy(buffer + _fatEntryPos(first) - blockStart, mount->fatCache.entries + first, (end - first) * sizeof(uint32_t));
         }
-
-        // Lookup next block in FAT
-        blockIdx = getBlockEntry(blockIdx).value;
-
-    } while (remainingLength > 0 && (blockIdx != END_OF_FILE && blockIdx != UNALLOCATED));
-
-    if (remainingOffset > 0) {
-        printf("EoF Reached.\n");
-        file_errno = EOTHER;
-        return -3;
-
-    } else if (remainingLength != 0) {
-        printf("ERROR! End of file with remaining length: %i\n", remainingLength);
-        file_errno = EOTHER;
-        return -6;
+        return;
     }
 
-    return 0;
-}
-
-int _allocateNewBlock(int lastBlockIdx, int *newBlockIdx) {
-    // Search for free block
-    unsigned char *fat = malloc(2 * numBlocks() + 1);
-    *newBlockIdx = -1;
-    if (_loadFAT(fat) != 0) {
-        file_errno = EOTHER;
-        free(fat);
-        return -1;
+    int first = (blockStart - mount->layout.fatOffset - (mount->layout.fieldSize - 1)) / mount->layout.fieldSize;
+    if (first < 0) {
+        first = 0;
     }
+    for (int i = first; i < numBlocks() && _fatEntryPos(i) < blockStart + blockSize(); i++) {
+        uint32_t value = mount->fatCache.entries[i];
+        if (value == END_OF_FILE) {
+            value = mount->layout.maxValue;
+        } else if (value == UNALLOCATED) {
+            value = mount->layout.maxValue - 1;
+        }
 
-    for (int i = 0; i < numBlocks(); i++) {
-
-        struct BlockEntry entry = getBlockEntry(i);
-
-        if (entry.value == UNALLOCATED) {
-            // Set new block -> END_OF_FILE
-            entry.value = END_OF_FILE;
-            if (setBlockEntry(entry) != 0) {
-                free(fat);
-                return -1;
-            }
-
-            *newBlockIdx = entry.idx;
-
-            if (lastBlockIdx > 0) {
-                // Set last block - > new block
-                struct BlockEntry updatedLastBlockEntry = {lastBlockIdx, entry.idx};
-                if (setBlockEntry(updatedLastBlockEntry) != 0) {
-                    free(fat);
-                    return -1;
-                }
+        // Entries may straddle two FAT blocks, only copy the bytes that land in this one
+        unsigned char encoded[4];
+        _putRaw(encoded, value);
+        int pos = _fatEntryPos(i) - blockStart;
+        for (int k = 0; k < mount->layout.fieldSize; k++) {
+            if (pos + k >= 0 && pos + k < blockSize()) {
+                buffer[pos + k] = encoded[k];
             }
-
-            // printf("Allocated new block: %i\n", *newBlockIdx);
-            free(fat);
-            return 0;
         }
     }
-
-    free(fat);
-    file_errno = ENOROOM;
-    printDevError("NO ROOM\n");
-    return -1;
 }
 
-int _append(int startBlockIdx, int currentLength, unsigned char *data, int dataLength) {
-    // Traverse to last block
-    int blockIdx = startBlockIdx;
-    while (getBlockEntry(blockIdx).value != END_OF_FILE) {
-        blockIdx = getBlockEntry(blockIdx).value;
+/**
+ * @brief Adds a freed block to the discard queue, extending the last range when they touch.
+ * The queue must have room.
+ */
+void _queueDiscard(int block) {
+    struct DiscardRange *last = (mount->discardQueue.count > 0) ? &mount->discardQueue.ranges[mount->discardQueue.count - 1] : NULL;
+    if (last != NULL && last->start + last->count == block) {
+        last->count++;
+    } else if (last != NULL && last->start - 1 == block) {
+        last->start--;
+        last->count++;
+    } else {
+        mount->discardQueue.ranges[mount->discardQueue.count].start = block;
+        mount->discardQueue.ranges[mount->discardQueue.count].count = 1;
+        mount->discardQueue.count++;
     }
+}
 
-    unsigned char buffer[BLOCK_SIZE];
-    if (blockRead(blockIdx, buffer) == -1) {
-        file_errno = EBADDEV;
-        printDevError("device err");
-        return -1;
+/**
+ * @brief Takes a block that is being allocated again out of the discard queue.
+ * A range split in two loses its second half if the queue is full, which only means less is discarded.
+ */
+void _unqueueDiscard(int block) {
+    for (int i = 0; i < mount->discardQueue.count; i++) {
+        struct DiscardRange *range = &mount->discardQueue.ranges[i];
+        if (block < range->start || block >= range->start + range->count) {
+            continue;
+        }
+
+        int end = range->start + range->count;
+        range->count = block - range->start;
+        if (block + 1 < end && mount->discardQueue.count < DISCARD_QUEUE_SIZE) {
+            mount->discardQueue.ranges[mount->discardQueue.count].start = block + 1;
+            mount->discardQueue.ranges[mount->discardQueue.count].count = end - block - 1;
+            mount->discardQueue.count++;
+        }
+        if (range->count == 0) {
+            *range = mount->discardQueue.ranges[--mount->discardQueue.count];
+        }
+        return;
     }
+}
 
-    // Start appending
-    int bufferPos = currentLength % BLOCK_SIZE;
-    int dataPos = 0;
-    while (dataPos < dataLength) {
-        // Check if block is full
-        if (bufferPos > BLOCK_SIZE - 1) {
-            // Commit current block
-            if (blockWrite(blockIdx, buffer)) {
-                file_errno = EBADDEV;
-                printDevError("device err");
-                return -1;
+/**
+ * @brief Sends the queued ranges to the device.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int _discardQueued() {
+    int failed = 0;
+    for (int i = 0; i < mount->discardQueue.count; i++) {
+        int end = mount->discardQueue.ranges[i].start + mount->discardQueue.ranges[i].count;
+        for (int b = mount->discardQueue.ranges[i].start; b < end; b++) {
+            // Hold each run of blocks still free while it is discarded, so no thread claims and
+            // writes one meanwhile. Blocks already claimed again are left alone.
+            int runStart = b;
+            while (b < end && _claimBlock(b)) {
+                b++;
             }
-
-            // Assign new block
-            int newBlockIdx;
-            if (_allocateNewBlock(blockIdx, &newBlockIdx) != 0) {
-                return -1;
+            if (b > runStart) {
+                failed |= blockDiscard(runStart, b - runStart) != 0;
+                for (int held = runStart; held < b; held++) {
+                    _releaseBlock(held);
+                }
             }
-            blockIdx = newBlockIdx;
-            bufferPos = 0;
         }
-
-        buffer[bufferPos] = data[dataPos];
-        dataPos++;
-        bufferPos++;
     }
+    mount->discardQueue.count = 0;
 
-    // Commit last block
-    if (blockWrite(blockIdx, buffer)) {
+    if (failed) {
         file_errno = EBADDEV;
         printDevError("device err");
         return -1;
     }
-
     return 0;
 }
 
 /**
- * @brief Get the DirectoryEntry from given directory file data
+ * @brief Writes every FAT block touched since the last flush back to the device,
+ * then discards the blocks it freed. fatLock must be held.
  *
- * @param cwdData char array of directory file data.
- * @param targetName file/directory name to retrieve the address for.
- * @param type 'F' for file, 'D' for directory
- * @return DirectoryEntry struct with all values -1 if not found, block index (address) and its length otherwise.
+ * @return int 0 for success, -1 for error.
  */
-struct DirectoryEntry
-_getAddressFromDirectoryFile(unsigned char *cwdData, int cwdLength, unsigned char *targetName, char type) {
-    // Get target
-    char target[9];
-    strncpy(target, (char *)targetName, 7);
-    target[7] = type;
-    target[8] = '\0';
+int _flushFATLocked() {
+    if (mount->fatCache.entries == NULL || mount->fatCache.dirtyLow == -1) {
+        return 0;
+    }
 
-    // Parse & search
-    struct DirectoryEntry addr = {-1, -1};
-    for (int i = 0; i < cwdLength; i += 12) {
-        char candidate[9];
-        strncpy(candidate, (char *)cwdData + i, 7);
-        candidate[7] = cwdData[i + 7];
-        target[8] = '\0';
-        if (strncmp(target, candidate, 8) == 0) {
-            // Found target file/directory - return addr
-            addr.startBlockIdx = _getDecoded(cwdData[i + 8], cwdData[i + 9]);
-            addr.filesize = _getDecoded(cwdData[i + 10], cwdData[i + 11]);
-            return addr;
+    int firstBlock = 1 + _fatEntryPos(mount->fatCache.dirtyLow) / blockSize();
+    int lastBlock = 1 + (_fatEntryPos(mount->fatCache.dirtyHigh) + mount->layout.fieldSize - 1) / blockSize();
+
+    for (int b = firstBlock; b <= lastBlock; b++) {
+        unsigned char *buffer = blockPinMut(b);
+        if (buffer == NULL) {
+            file_errno = EBADDEV;
+            printDevError("device err");
+            return -1;
+        }
+        _encodeFATBlock(b, buffer);
+        if (blockUnpin(buffer)) {
+            file_errno = EBADDEV;
+            printDevError("device err");
+            return -1;
         }
     }
 
-    // Not found
-    return addr;
+    mount->fatCache.dirtyLow = -1;
+    mount->fatCache.dirtyHigh = -1;
+    return _discardQueued();
 }
 
-/**
- * @brief Get the DirectoryEntry From directory
- *
- * @param cwd start index of the block containing the working directory file
- * @param targetName file/directory name to retrieve the address for.
- * @param type 'F' for file, 'D' for directory
- * @return DirectoryEntry struct with all values -1 if not found, block index (address) and its length otherwise.
- */
-struct DirectoryEntry
-getAddressFromDirectory(int cwd, int cwdLength, unsigned char *targetName, char type) {
-    // Read directory
-    if (cwdLength > 0) {
-        unsigned char *data = malloc(cwdLength);
-        if (_read(cwd, cwdLength, 0, data) != 0) {
-            file_errno = EOTHER;
-            struct DirectoryEntry addr = {-1, -1};
-            free(data);
-            return addr;
-        }
+int _flushFAT() {
+    pthread_mutex_lock(&mount->fatLock);
+    int result = _flushFATLocked();
+    pthread_mutex_unlock(&mount->fatLock);
+    return result;
+}
 
-        struct DirectoryEntry result = _getAddressFromDirectoryFile(data, cwdLength, targetName, type);
-        free(data);
-        return result;
+struct BlockEntry getBlockEntry(int block) {
+    struct BlockEntry entry = {-1, -1};
+
+    if (_loadFAT() != 0) {
+        return entry;
+    }
+    if (block < 0 || block >= numBlocks()) {
+        file_errno = EOTHER;
+        return entry;
     }
 
-    // empty directory - not found.
-    struct DirectoryEntry addr = {-1, -1};
-    return addr;
-}
+    entry.idx = block;
+    entry.value = __atomic_load_n(&mount->fatCache.entries[block], __ATOMIC_RELAXED);
+
+    return entry;
+}
+
+/**
+ * @brief Changes a FAT entry in fatCache, to be written back by the next flush. fatLock must be held.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int setBlockEntry(struct BlockEntry entry) {
+    if (_loadFATLocked() != 0) {
+        return -1;
+    }
+    if (entry.idx < 0 || entry.idx >= numBlocks() || entry.value < 0 || entry.value > END_OF_FILE) {
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    // Keep the free map and the discard queue in step with allocation state changes.
+    // A block being linked has normally been claimed already.
+    int wasFree = mount->fatCache.entries[entry.idx] == UNALLOCATED;
+    int isFree = entry.value == UNALLOCATED;
+    if (!wasFree && isFree && mount->discardQueue.count == DISCARD_QUEUE_SIZE && _flushFATLocked() != 0) {
+        return -1;
+    }
+    if (wasFree && !isFree) {
+        _claimBlock(entry.idx);
+        _unqueueDiscard(entry.idx);
+    } else if (!wasFree && isFree) {
+        _releaseBlock(entry.idx);
+        _queueDiscard(entry.idx);
+    }
+
+    __atomic_store_n(&mount->fatCache.entries[entry.idx], (uint32_t)entry.value, __ATOMIC_RELAXED);
+
+    // Widen dirty range, written back on the next _flushFAT().
+    if (mount->fatCache.dirtyLow == -1 || entry.idx < mount->fatCache.dirtyLow) {
+        mount->fatCache.dirtyLow = entry.idx;
+    }
+    if (entry.idx > mount->fatCache.dirtyHigh) {
+        mount->fatCache.dirtyHigh = entry.idx;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Allocates the file pointers once the number of blocks is known, with filePointerLock held.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int _reserveFilePointers() {
+    if (mount->filePointers == NULL) {
+        mount->filePointers = calloc(numBlocks(), sizeof(struct FilePointer));
+        if (mount->filePointers == NULL) {
+            file_errno = EOTHER;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief After a device restart, file pointers (which are memory constructs) are lost. We must regenerate a file pointer list everytime it is restarted (with offsets reset back to 0).
+ * Called with filePointerLock held. Holds fatLock while it walks the chains, so none is half extended.
+ */
+void regenerateFilePointers() {
+    // printf("Regenerating file pointers\n");
+    if (_reserveFilePointers() != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&mount->fatLock);
+    if (_loadFATLocked() != 0) {
+        pthread_mutex_unlock(&mount->fatLock);
+        return;
+    }
+
+    int *visited = calloc(numBlocks(), sizeof(int)); // visited array of blocks
+
+    for (int i = getRootIndex(); i < numBlocks(); i++) {
+        int candidateStartIdx = i;
+        struct BlockEntry entry = getBlockEntry(i);
+        if (entry.value != UNALLOCATED && visited[i] != 1) {
+            visited[i] = 1;
+
+            int iterationDepth = 0;
+            // traverse linked list
+            while (entry.value != END_OF_FILE) {
+                visited[entry.value] = 1;
+                entry = getBlockEntry(entry.value);
+                iterationDepth++;
+
+                if (iterationDepth > numBlocks()) {
+                    printf("ERROR: Detected loop while regenerating file pointers. May indicate malformed file allocation table.");
+                    file_errno = EOTHER;
+                    pthread_mutex_unlock(&mount->fatLock);
+                    free(visited);
+                    return;
+                }
+            }
+
+            // Recovery file pointers
+            mount->filePointers[mount->nOpenFiles].startBlockIdx = candidateStartIdx;
+            mount->filePointers[mount->nOpenFiles].offset = 0;
+            mount->filePointers[mount->nOpenFiles].cursor.blockIdx = -1;
+            mount->nOpenFiles++;
+        }
+    }
+    pthread_mutex_unlock(&mount->fatLock);
+
+    free(visited);
+}
+
+/**
+ * @brief Gets the lock of the file or directory starting at a block, creating it the first time.
+ *
+ * @return struct ChainLock* or NULL (with file_errno set) on error.
+ */
+struct ChainLock *_getChainLock(int startBlockIdx) {
+    pthread_mutex_lock(&mount->chainLocksLock);
+    struct ChainLock **bucket = &mount->chainLocks[(uint32_t)startBlockIdx * 2654435761u % CHAIN_LOCK_BUCKETS];
+    struct ChainLock *chain = *bucket;
+    while (chain != NULL && chain->startBlockIdx != startBlockIdx) {
+        chain = chain->next;
+    }
+    if (chain == NULL && (chain = malloc(sizeof(struct ChainLock))) != NULL) {
+        chain->startBlockIdx = startBlockIdx;
+        chain->length = -1;
+        pthread_rwlock_init(&chain->lock, NULL);
+        chain->next = *bucket;
+        *bucket = chain;
+    }
+    pthread_mutex_unlock(&mount->chainLocksLock);
+
+    if (chain == NULL) {
+        file_errno = EOTHER;
+    }
+    return chain;
+}
+
+/**
+ * @brief Locks the file or directory starting at a block.
+ *
+ * @param startBlockIdx
+ * @param exclusive 1 to lock it for writing, 0 for reading
+ * @return struct ChainLock* for _unlockChain, or NULL (with file_errno set) on error.
+ */
+struct ChainLock *_lockChain(int startBlockIdx, int exclusive) {
+    struct ChainLock *chain = _getChainLock(startBlockIdx);
+    if (chain == NULL) {
+        return NULL;
+    }
+    if (exclusive) {
+        pthread_rwlock_wrlock(&chain->lock);
+    } else {
+        pthread_rwlock_rdlock(&chain->lock);
+    }
+    return chain;
+}
+
+void _unlockChain(struct ChainLock *chain) {
+    if (chain != NULL) {
+        pthread_rwlock_unlock(&chain->lock);
+    }
+}
+
+/**
+ * @brief Size of a directory file, for a caller holding the directory's lock.
+ *
+ * @return int size, or negative on error.
+ */
+int _dirLength(struct ChainLock *dir) {
+    if (dir->startBlockIdx == getRootIndex()) {
+        return _getRootSize();
+    }
+
+    int length = __atomic_load_n(&dir->length, __ATOMIC_RELAXED);
+    if (length < 0) {
+        file_errno = EOTHER;
+    }
+    return length;
+}
+
+/**
+ * @brief Records the size of a directory, for a caller holding the lock of the directory holding its entry.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int _noteDirLength(int dirBlockIdx, int length) {
+    struct ChainLock *dir = _getChainLock(dirBlockIdx);
+    if (dir == NULL) {
+        return -1;
+    }
+    __atomic_store_n(&dir->length, length, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief Frees every lock in the registry, with the directory sizes recorded with them, when the device is
+ * reformatted or converted (with the device to itself, so no lock is held) or unmounted. Block numbers are
+ * reused by other files after a format, they start again with fresh locks.
+ */
+void _freeChainLocks() {
+    for (int i = 0; i < CHAIN_LOCK_BUCKETS; i++) {
+        while (mount->chainLocks[i] != NULL) {
+            struct ChainLock *chain = mount->chainLocks[i];
+            mount->chainLocks[i] = chain->next;
+            pthread_rwlock_destroy(&chain->lock);
+            free(chain);
+        }
+    }
+}
+
+/*
+ * Formats the device with the given on-disk layout (one of the FS_ values).
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int formatLayout(char *volumeName, int fsLayout) {
+    if (fsLayout < 0 || fsLayout >= NUM_LAYOUTS) {
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    resetBlocks(); // Optional - useful for testing.
+
+    // Clear file pointers
+    if (_reserveFilePointers() != 0) {
+        return -1;
+    }
+    memset(mount->filePointers, 0, mount->nOpenFiles * sizeof(struct FilePointer)); // only these have been used
+    mount->nOpenFiles = 0;
+    memset(mount->tailCache, 0, sizeof(mount->tailCache));
+    memset(mount->handles, 0, sizeof(mount->handles));
+    memset(mount->dirHandles, 0, sizeof(mount->dirHandles));
+    memset(mount->dentryCache, 0, sizeof(mount->dentryCache));
+    _freeChainLocks();
+    mount->rootSize = 0;
+    mount->discardQueue.count = 0;
+    free(mount->subtreeSizes.slots);
+    mount->subtreeSizes.slots = NULL;
+    mount->subtreeSizes.capacity = 0;
+    mount->subtreeSizes.count = 0;
+
+    mount->layout = layouts[fsLayout];
+    mount->root_block_idx = _reservedBlocks();
+
+    // Check block number validity
+    int reserved_blocks = mount->root_block_idx;
+    if ((numBlocks() - reserved_blocks) < 0) {
+        file_errno = ENOROOM;
+        return -1;
+    }
+
+    // The top two values of a FAT entry are reserved
+    if ((uint32_t)numBlocks() > mount->layout.maxValue - 1) {
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    // Check volume name validiity
+    if (strlen(volumeName) > (VOLUME_NAME_SIZE - 1)) {
+        file_errno = EBADVOLNAME;
+        return -1;
+    }
+
+    /**
+     * Create FAT - every 2 characters ('WFS', 'WFL2') or 4 characters ('WF2', 'WFL4') represents both an
+     * 'allocated' flag and the next block value in linked list.
+     *
+     * ==============
+     *    ENCODING
+     * --------------
+     * ALL VALUES INCLUSIVE.
+     *
+     *  WFS, WFL2  :     WF2        :     WFL4       :
+     * 0-65533     : 0-4294967293   : 0-2147483645   : NEXT BLOCK INDEX
+     * 65534       : 4294967294     : 2147483646     : UNALLOCATED BLOCK
+     * 65535       : 4294967295     : 2147483647     : END OF FILE
+     * ==============
+     */
+    free(mount->fatCache.entries);
+    mount->fatCache.entries = malloc(numBlocks() * sizeof(uint32_t));
+    if (mount->fatCache.entries == NULL) {
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    int nBlocks = numBlocks();
+    for (int i = 0; i < nBlocks; i++) {
+        // Set to allocated if it is a reserved block or the root (i.e. last reserved block idx + 1).
+        mount->fatCache.entries[i] = (i <= reserved_blocks) ? END_OF_FILE : UNALLOCATED;
+    }
+
+    mount->fatCache.dirtyLow = -1;
+    mount->fatCache.dirtyHigh = -1;
+    if (_buildFreeMap() != 0) {
+        return -1;
+    }
+
+    // Build the whole system area in memory and write it out in one go.
+    unsigned char *image = calloc(reserved_blocks, blockSize());
+    if (image == NULL) {
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    // Set volume name to first block, followed by the geometry if there is room for it
+    strncpy((char *)image, volumeName, VOLUME_NAME_SIZE);
+    if (blockSize() >= GEOMETRY_OFFSET + GEOMETRY_SIZE) {
+        geometryRecord(image + GEOMETRY_OFFSET);
+    }
+
+    // Assign the layout's identifier (used to quickly check if a device has been formatted before, and how)
+    // Root directory size starts at 0
+    unsigned char *header = image + blockSize();
+    memcpy(header, mount->layout.id, strlen(mount->layout.id));
+
+    for (int b = 1; b < reserved_blocks; b++) {
+        _encodeFATBlock(b, image + b * blockSize());
+    }
+
+    if (blockWriteRange(0, reserved_blocks, image) == -1) {
+        file_errno = EBADDEV;
+        printDevError("device err");
+        free(image);
+        return -1;
+    }
+
+    free(image);
+    return 0;
+}
+
+/**
+ * @brief Whether a layout's fields can address every block of the device, and size a file
+ * filling all the blocks after the root directory.
+ */
+int _layoutFitsDevice(int fsLayout) {
+    const struct Layout *layout = &layouts[fsLayout];
+    int64_t dataBytes = (int64_t)(numBlocks() - _layoutReservedBlocks(layout) - 1) * blockSize();
+    return (uint32_t)numBlocks() <= layout->maxValue - 1 && dataBytes <= (int64_t)layout->maxValue;
+}
+
+/*
+ * Formats the device for use by this file system.
+ * The volume name must be < 64 bytes long.
+ * All information previously on the device is lost.
+ * Also creates the root directory "/".
+ * Uses the native 'WFL2' layout, or 'WFL4' on devices with more blocks than 16 bit FAT entries can
+ * address, or room for files larger than 16 bit sizes can hold.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int format(char *volumeName) {
+    return formatLayout(volumeName, _layoutFitsDevice(FS_WFL2) ? FS_WFL2 : FS_WFL4);
+}
+
+/*
+ * Returns the volume's name in the result.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int volumeName(char *result) {
+    if (isFormatted() != 1) {
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    const unsigned char *name = blockPin(0);
+    if (name == NULL) {
+        file_errno = EBADDEV;
+        printDevError("device err");
+        return -1;
+    }
+    memcpy(result, name, VOLUME_NAME_SIZE);
+    blockUnpin(name);
+
+    return 0;
+}
+
+int _min(int n0, int n1) {
+    if (n0 < n1) {
+        return n0;
+    } else {
+        return n1;
+    }
+}
+
+#define READ_IN_FLIGHT 32 // block runs a read keeps in flight at once
+
+/**
+ * @brief Waits for every read in flight, so none is left writing into the caller's buffer.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int _waitReads(int *inFlight, int *nInFlight) {
+    int result = 0;
+    for (int i = 0; i < *nInFlight; i++) {
+        if (blockWait(inFlight[i])) {
+            result = -1;
+        }
+    }
+    *nInFlight = 0;
+
+    if (result) {
+        file_errno = EBADDEV;
+        printDevError("device err");
+    }
+    return result;
+}
+
+/**
+ * @brief Starts reading a run of consecutive blocks, waiting for the reads in flight first if there are too many.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int _startRead(int start, int count, unsigned char *dest, int *inFlight, int *nInFlight) {
+    if (*nInFlight == READ_IN_FLIGHT && _waitReads(inFlight, nInFlight)) {
+        return -1;
+    }
+
+    int request = blockReadAsync(start, count, dest);
+    if (request < 0) {
+        file_errno = EBADDEV;
+        printDevError("device err");
+        return -1;
+    }
+    inFlight[(*nInFlight)++] = request;
+    return 0;
+}
+
+/**
+ * @brief Reads a specified amount of data from a given offset of the file starting at the specified block.
+ * Blocks before the offset are skipped through the FAT without being read from the device.
+ *
+ * @param startBlockIdx
+ * @param offset byte offset into the file to start reading from
+ * @param length amount of characters to read (excl. null terminator)
+ * @param result
+ * @param cursor optional position to resume from if it is not past offset. Left at the last block read.
+ * @return int 0 for success, negative for error.
+ */
+int _readAt(int startBlockIdx, int offset, int length, unsigned char *result, struct BlockCursor *cursor) {
+    if (length <= 0) {
+        return 0;
+    }
+
+    int blockIdx = startBlockIdx;
+    int blockStart = 0;
+    if (cursor != NULL && cursor->blockIdx >= 0 && cursor->blockStart <= offset) {
+        blockIdx = cursor->blockIdx;
+        blockStart = cursor->blockStart;
+    }
+
+    // Skip whole blocks before the offset
+    while (offset - blockStart >= blockSize()) {
+        blockIdx = getBlockEntry(blockIdx).value;
+        blockStart += blockSize();
+        if (blockIdx < 0 || blockIdx == END_OF_FILE || blockIdx == UNALLOCATED) {
+            printf("EoF Reached.\n");
+            file_errno = EOTHER;
+            return -3;
+        }
+    }
+
+    // Whole blocks are read straight into the result, consecutive ones together, with
+    // several runs in flight while the rest of the chain is followed.
+    int inFlight[READ_IN_FLIGHT];
+    int nInFlight = 0;
+    int runStart = -1;
+    int runCount = 0;
+    unsigned char *runDest = NULL;
+
+    int done = 0;
+    while (1) {
+        int blockPos = offset + done - blockStart;
+        int chunk = _min(blockSize() - blockPos, length - done);
+
+        if (chunk == blockSize() && runCount > 0 && blockIdx == runStart + runCount) {
+            runCount++;
+        } else if (chunk == blockSize()) {
+            if (runCount > 0 && _startRead(runStart, runCount, runDest, inFlight, &nInFlight)) {
+                _waitReads(inFlight, &nInFlight);
+                return -1;
+            }
+            runStart = blockIdx;
+            runCount = 1;
+            runDest = result + done;
+        } else {
+            // Part of a block - copy just that part from the device
+            const unsigned char *blockData = blockPin(blockIdx);
+            if (blockData == NULL) {
+                file_errno = EBADDEV;
+                printDevError("device err");
+                _waitReads(inFlight, &nInFlight);
+                return -1;
+            }
+            memcpy(result + done, blockData + blockPos, chunk);
+            blockUnpin(blockData);
+        }
+        done += chunk;
+
+        if (done >= length) {
+            break;
+        }
+
+        // Lookup next block in FAT
+        blockIdx = getBlockEntry(blockIdx).value;
+        blockStart += blockSize();
+        if (blockIdx < 0 || blockIdx == END_OF_FILE || blockIdx == UNALLOCATED) {
+            printf("ERROR! End of file with remaining length: %i\n", length - done);
+            file_errno = EOTHER;
+            _waitReads(inFlight, &nInFlight);
+            return -6;
+        }
+    }
+
+    if (runCount > 0 && _startRead(runStart, runCount, runDest, inFlight, &nInFlight)) {
+        _waitReads(inFlight, &nInFlight);
+        return -1;
+    }
+    if (_waitReads(inFlight, &nInFlight)) {
+        return -1;
+    }
+
+    if (cursor != NULL) {
+        cursor->blockIdx = blockIdx;
+        cursor->blockStart = blockStart;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Reads a specified amount of data starting at the specified block.
+ *
+ * @param startBlockIdx
+ * @param length amount of characters to read (excl. null terminator)
+ * @param result
+ * @return int 0 for success, -1 for error.
+ */
+int _read(int startBlockIdx, int length, int offset, unsigned char *result) {
+    result[0] = '\0';
+    return _readAt(startBlockIdx, offset, length, result, NULL);
+}
+
+/**
+ * @brief Links claimed blocks onto the end of a chain, in the given order, the last one ending the file.
+ * The new blocks are linked back to front and the old tail last, so the chain never leads to a block
+ * that isn't part of it yet.
+ *
+ * @param lastBlockIdx current tail block of the chain, or -1 to start a new chain.
+ * @return int 0 for success, -1 for error.
+ */
+int _linkBlocks(int lastBlockIdx, int count, int *blocks) {
+    pthread_mutex_lock(&mount->fatLock);
+    int result = 0;
+    for (int i = count - 1; i >= 0 && result == 0; i--) {
+        struct BlockEntry entry = {blocks[i], (i == count - 1) ? END_OF_FILE : blocks[i + 1]};
+        result = setBlockEntry(entry);
+    }
+    if (result == 0 && lastBlockIdx > 0) {
+        struct BlockEntry prevEntry = {lastBlockIdx, blocks[0]};
+        result = setBlockEntry(prevEntry);
+    }
+    pthread_mutex_unlock(&mount->fatLock);
+    return result;
+}
+
+/**
+ * @brief Claims count blocks and links them straight onto the end of a chain.
+ *
+ * @param group allocation group of a new chain.
+ * @param lastBlockIdx current tail block of the chain, or -1 to start a new chain.
+ * @param blocks filled in with the new block indices, in chain order.
+ * @return int 0 for success, -1 for error.
+ */
+int _allocateBlocks(int group, int lastBlockIdx, int count, int *blocks) {
+    if (_loadFAT() != 0 || _claimBlocks(group, lastBlockIdx, count, blocks) != 0) {
+        return -1;
+    }
+    return _linkBlocks(lastBlockIdx, count, blocks);
+}
+
+/**
+ * @brief Records the tail block and length of the file starting at startBlockIdx.
+ */
+void _setTailBlock(int startBlockIdx, int lastBlockIdx, int length) {
+    pthread_mutex_lock(&mount->tailLock);
+    struct TailCacheEntry *slot = &mount->tailCache[startBlockIdx % TAIL_CACHE_SIZE];
+    slot->startBlockIdx = startBlockIdx;
+    slot->lastBlockIdx = lastBlockIdx;
+    slot->length = length;
+    pthread_mutex_unlock(&mount->tailLock);
+}
+
+/**
+ * @brief Gets the last block of a file, from the tail cache if possible.
+ *
+ * @param startBlockIdx first block of the file.
+ * @param length current file length, used to validate the cached entry.
+ * @return int index of the last block, or -1 on error.
+ */
+int _getTailBlock(int startBlockIdx, int length) {
+    pthread_mutex_lock(&mount->tailLock);
+    struct TailCacheEntry slot = mount->tailCache[startBlockIdx % TAIL_CACHE_SIZE];
+    pthread_mutex_unlock(&mount->tailLock);
+    if (slot.startBlockIdx == startBlockIdx && slot.length == length) {
+        return slot.lastBlockIdx;
+    }
+
+    // Miss - traverse to last block and remember it.
+    int blockIdx = startBlockIdx;
+    int depth = 0;
+    while (getBlockEntry(blockIdx).value != END_OF_FILE) {
+        blockIdx = getBlockEntry(blockIdx).value;
+        if (blockIdx < 0 || ++depth > numBlocks()) {
+            file_errno = EOTHER;
+            return -1;
+        }
+    }
+
+    _setTailBlock(startBlockIdx, blockIdx, length);
+    return blockIdx;
+}
+
+/**
+ * @brief Starts a new chain in an allocation group, an empty file whose only block is also its tail.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int _allocateNewBlock(int group, int *newBlockIdx) {
+    *newBlockIdx = -1;
+    if (_allocateBlocks(group, -1, 1, newBlockIdx) != 0) {
+        return -1;
+    }
+
+    _setTailBlock(*newBlockIdx, *newBlockIdx, 0);
+    return 0;
+}
+
+/**
+ * @brief Returns every block of a chain to the free map, with fatLock held.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int _freeChainLocked(int startBlockIdx) {
+    if (_loadFATLocked() != 0) {
+        return -1;
+    }
+
+    int blockIdx = startBlockIdx;
+    for (int depth = 0; depth <= numBlocks(); depth++) {
+        int next = getBlockEntry(blockIdx).value;
+        struct BlockEntry entry = {blockIdx, UNALLOCATED};
+        if (next < 0 || next == UNALLOCATED || setBlockEntry(entry) != 0) {
+            file_errno = EOTHER;
+            return -1;
+        }
+        if (next == END_OF_FILE) {
+            return 0;
+        }
+        blockIdx = next;
+    }
+
+    // Loop in the chain
+    file_errno = EOTHER;
+    return -1;
+}
+
+int _freeChain(int startBlockIdx) {
+    pthread_mutex_lock(&mount->fatLock);
+    int result = _freeChainLocked(startBlockIdx);
+    pthread_mutex_unlock(&mount->fatLock);
+    return result;
+}
+
+/**
+ * @brief Writes appended data: the part that fits into the tail block, then the new blocks,
+ * the last of them zero padded.
+ *
+ * @param blockIdx tail block of the file.
+ * @param bufferPos where the data starts in the tail block.
+ * @param tailLength bytes of data that go into the tail block.
+ * @param newBlocks blocks for the rest, in order.
+ * @return int 0 for success, -1 for error.
+ */
+int _writeAppended(int blockIdx, int bufferPos, int tailLength, int *newBlocks, int nNewBlocks, unsigned char *data, int dataLength) {
+    // Top up the tail block
+    if (tailLength > 0) {
+        unsigned char *tail = blockPinMut(blockIdx);
+        if (tail == NULL) {
+            file_errno = EBADDEV;
+            printDevError("device err");
+            return -1;
+        }
+        memcpy(tail + bufferPos, data, tailLength);
+        if (blockUnpin(tail)) {
+            file_errno = EBADDEV;
+            printDevError("device err");
+            return -1;
+        }
+    }
+
+    // Write the new full blocks straight from the caller's data in one vectored call.
+    int nFull = (dataLength - tailLength) / blockSize();
+    if (nFull > 0) {
+        unsigned char **bufs = malloc(nFull * sizeof(unsigned char *));
+        if (bufs == NULL) {
+            file_errno = EOTHER;
+            return -1;
+        }
+        for (int i = 0; i < nFull; i++) {
+            bufs[i] = data + tailLength + i * blockSize();
+        }
+        int failed = blockWritev(newBlocks, bufs, nFull);
+        free(bufs);
+        if (failed) {
+            file_errno = EBADDEV;
+            printDevError("device err");
+            return -1;
+        }
+    }
+
+    // The last block may only be partly filled, zero pad it.
+    if (nFull < nNewBlocks) {
+        int dataPos = tailLength + nFull * blockSize();
+        unsigned char *dest = blockPinMut(newBlocks[nFull]);
+        if (dest == NULL) {
+            file_errno = EBADDEV;
+            printDevError("device err");
+            return -1;
+        }
+        memcpy(dest, data + dataPos, dataLength - dataPos);
+        memset(dest + dataLength - dataPos, '\0', blockSize() - (dataLength - dataPos));
+        if (blockUnpin(dest)) {
+            file_errno = EBADDEV;
+            printDevError("device err");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int _append(int startBlockIdx, int currentLength, unsigned char *data, int dataLength) {
+    if (dataLength <= 0) {
+        return 0;
+    }
+
+    int blockIdx = _getTailBlock(startBlockIdx, currentLength);
+    if (blockIdx == -1) {
+        return -1;
+    }
+
+    // Room left in the tail block (none if the file exactly fills it).
+    int bufferPos = currentLength % blockSize();
+    int tailRoom = (currentLength > 0 && bufferPos == 0) ? 0 : blockSize() - bufferPos;
+    int tailLength = _min(tailRoom, dataLength);
+
+    // Claim every block the rest of the data needs up front, they are only linked to the file once written.
+    int nNewBlocks = (dataLength - tailLength + blockSize() - 1) / blockSize();
+    int *newBlocks = NULL;
+    if (nNewBlocks > 0) {
+        newBlocks = malloc(nNewBlocks * sizeof(int));
+        if (newBlocks == NULL) {
+            file_errno = EOTHER;
+            return -1;
+        }
+        if (_loadFAT() != 0 || _claimBlocks(0, blockIdx, nNewBlocks, newBlocks) != 0) {
+            free(newBlocks);
+            return -1;
+        }
+    }
+
+    if (_writeAppended(blockIdx, bufferPos, tailLength, newBlocks, nNewBlocks, data, dataLength) != 0) {
+        _releaseBlocks(newBlocks, nNewBlocks);
+        free(newBlocks);
+        return -1;
+    }
+    if (nNewBlocks > 0 && _linkBlocks(blockIdx, nNewBlocks, newBlocks) != 0) {
+        free(newBlocks);
+        return -1;
+    }
+
+    int lastBlockIdx = (nNewBlocks > 0) ? newBlocks[nNewBlocks - 1] : blockIdx;
+    _setTailBlock(startBlockIdx, lastBlockIdx, currentLength + dataLength);
+
+    free(newBlocks);
+    return 0;
+}
+
+/**
+ * @brief Builds the 8 byte key a directory entry starts with - the null padded name followed by the type.
+ */
+void _makeKey(unsigned char *key, unsigned char *name, char type) {
+    memset(key, 0, 8);
+    strncpy((char *)key, (char *)name, 7);
+    key[7] = type;
+}
+
+/**
+ * @brief FNV-1a hash, continuing from the given hash value.
+ */
+uint32_t _fnv1a(uint32_t hash, unsigned char *data, int length) {
+    for (int i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+#define FNV_OFFSET_BASIS 2166136261u
+
+/**
+ * @brief Checks whether a directory entry holds the given name and type.
+ * Names shorter than 7 bytes are null padded on the device.
+ */
+int _entryMatches(unsigned char *entry, unsigned char *targetName, char type) {
+    unsigned char target[8];
+    _makeKey(target, targetName, type);
+    return memcmp(target, entry, 8) == 0;
+}
+
+/**
+ * @brief Get the DirectoryEntry from given directory file data
+ *
+ * @param cwdData char array of directory file data.
+ * @param targetName file/directory name to retrieve the address for.
+ * @param type 'F' for file, 'D' for directory
+ * @return DirectoryEntry struct with all values -1 if not found, block index (address) and its length otherwise.
+ */
+struct DirectoryEntry
+_getAddressFromDirectoryFile(unsigned char *cwdData, int cwdLength, unsigned char *targetName, char type) {
+    // Parse & search
+    struct DirectoryEntry addr = {-1, -1, -1};
+    for (int i = 0; i < cwdLength; i += mount->layout.entrySize) {
+        if (_entryMatches(cwdData + i, targetName, type)) {
+            // Found target file/directory - return addr
+            addr.startBlockIdx = _entryStartBlock(cwdData + i);
+            addr.filesize = _entryFilesize(cwdData + i);
+            addr.entryOffset = i;
+            return addr;
+        }
+    }
+
+    // Not found
+    return addr;
+}
+
+/**
+ * @brief Gets the dentry cache slot for a (parent directory, name, type) key.
+ *
+ * @param key filled in with the 8 byte key stored in the slot.
+ */
+struct DentryCacheEntry *_dentrySlot(int parentBlockIdx, unsigned char *name, char type, unsigned char *key) {
+    _makeKey(key, name, type);
+
+    // Hash the parent block and key
+    unsigned char parent[4] = {parentBlockIdx & 0xff, (parentBlockIdx >> 8) & 0xff, (parentBlockIdx >> 16) & 0xff,
+                               (parentBlockIdx >> 24) & 0xff};
+    uint32_t hash = _fnv1a(_fnv1a(FNV_OFFSET_BASIS, parent, 4), key, 8);
+
+    return &mount->dentryCache[hash % DENTRY_CACHE_SIZE];
+}
+
+/**
+ * @brief Looks an entry up in the dentry cache.
+ *
+ * @return int 1 if it was cached (and entry filled in), 0 otherwise.
+ */
+int _dentryLookup(int parentBlockIdx, unsigned char *name, char type, struct DirectoryEntry *entry) {
+    unsigned char key[8];
+    pthread_mutex_lock(&mount->dentryLock);
+    struct DentryCacheEntry *slot = _dentrySlot(parentBlockIdx, name, type, key);
+    int hit = slot->valid && slot->parentBlockIdx == parentBlockIdx && memcmp(slot->key, key, 8) == 0;
+    if (hit) {
+        *entry = slot->entry;
+    }
+    pthread_mutex_unlock(&mount->dentryLock);
+    return hit;
+}
+
+/**
+ * @brief Records the result of a lookup (or a change to an entry) in the dentry cache.
+ * The caller holds the parent directory's lock, so the entry can't be changing.
+ */
+void _dentryStore(int parentBlockIdx, unsigned char *name, char type, struct DirectoryEntry entry) {
+    unsigned char key[8];
+    pthread_mutex_lock(&mount->dentryLock);
+    struct DentryCacheEntry *slot = _dentrySlot(parentBlockIdx, name, type, key);
+    slot->valid = 1;
+    slot->parentBlockIdx = parentBlockIdx;
+    memcpy(slot->key, key, 8);
+    slot->entry = entry;
+    pthread_mutex_unlock(&mount->dentryLock);
+}
+
+/**
+ * @brief Updates the filesize of a cached entry, if it is cached.
+ */
+void _dentryUpdateSize(int parentBlockIdx, unsigned char *name, char type, int filesize) {
+    unsigned char key[8];
+    pthread_mutex_lock(&mount->dentryLock);
+    struct DentryCacheEntry *slot = _dentrySlot(parentBlockIdx, name, type, key);
+    if (slot->valid && slot->parentBlockIdx == parentBlockIdx && memcmp(slot->key, key, 8) == 0) {
+        slot->entry.filesize = filesize;
+    }
+    pthread_mutex_unlock(&mount->dentryLock);
+}
+
+/**
+ * @brief Gets the index entry of a directory (the hidden 'I' entry at offset 0), if it has one.
+ *
+ * @param dirBlock start block of the directory
+ * @return DirectoryEntry of the index file, startBlockIdx -1 if the directory is not indexed.
+ */
+struct DirectoryEntry _getDirIndex(int dirBlock) {
+    struct DirectoryEntry index = {-1, -1, -1};
+    if (_dentryLookup(dirBlock, (unsigned char *)"", 'I', &index)) {
+        return index;
+    }
+
+    unsigned char first[MAX_ENTRY_SIZE];
+    if (_readAt(dirBlock, 0, mount->layout.entrySize, first, NULL) != 0) {
+        return index;
+    }
+    if (first[7] == 'I') {
+        index.startBlockIdx = _entryStartBlock(first);
+        index.filesize = _entryFilesize(first);
+        index.entryOffset = 0;
+    }
+
+    _dentryStore(dirBlock, (unsigned char *)"", 'I', index);
+    return index;
+}
+
+/**
+ * @brief Finds an entry through a directory's hashed index.
+ * Reads one slot block per probe and the block(s) holding the candidate entry.
+ *
+ * @param dirBlock start block of the directory
+ * @param index the directory's index entry
+ * @param targetName file/directory name to retrieve the address for.
+ * @param type 'F' for file, 'D' for directory
+ * @return DirectoryEntry struct with all values -1 if not found, block index (address) and its length otherwise.
+ */
+struct DirectoryEntry _indexLookup(int dirBlock, struct DirectoryEntry index, unsigned char *targetName, char type) {
+    struct DirectoryEntry addr = {-1, -1, -1};
+    unsigned char key[8];
+    _makeKey(key, targetName, type);
+
+    int capacity = index.filesize / mount->layout.fieldSize;
+    int slot = _fnv1a(FNV_OFFSET_BASIS, key, 8) & (capacity - 1);
+    for (int probe = 0; probe < capacity; probe++) {
+        unsigned char field[4];
+        if (_readAt(index.startBlockIdx, slot * mount->layout.fieldSize, mount->layout.fieldSize, field, NULL) != 0) {
+            file_errno = EOTHER;
+            return addr;
+        }
+
+        // Slots hold the entry number + 1, 0 marks an empty slot.
+        int ordinal = _getDecoded(field);
+        if (ordinal == 0) {
+            return addr;
+        }
+
+        unsigned char entry[MAX_ENTRY_SIZE];
+        if (_readAt(dirBlock, (ordinal - 1) * mount->layout.entrySize, mount->layout.entrySize, entry, NULL) != 0) {
+            file_errno = EOTHER;
+            return addr;
+        }
+        if (memcmp(entry, key, 8) == 0) {
+            addr.startBlockIdx = _entryStartBlock(entry);
+            addr.filesize = _entryFilesize(entry);
+            addr.entryOffset = (ordinal - 1) * mount->layout.entrySize;
+            return addr;
+        }
+
+        slot = (slot + 1) & (capacity - 1);
+    }
+
+    return addr;
+}
+
+/**
+ * @brief Get the DirectoryEntry From directory
+ *
+ * @param cwd start index of the block containing the working directory file
+ * @param targetName file/directory name to retrieve the address for.
+ * @param type 'F' for file, 'D' for directory
+ * @return DirectoryEntry struct with all values -1 if not found, block index (address) and its length otherwise.
+ */
+struct DirectoryEntry
+getAddressFromDirectory(int cwd, int cwdLength, unsigned char *targetName, char type) {
+    // Only directories that have reached the threshold can have an index
+    if (cwdLength >= DIR_INDEX_THRESHOLD * mount->layout.entrySize) {
+        struct DirectoryEntry index = _getDirIndex(cwd);
+        if (index.startBlockIdx != -1) {
+            return _indexLookup(cwd, index, targetName, type);
+        }
+    }
+
+    // Scan the directory in place, one block at a time.
+    struct DirectoryEntry addr = {-1, -1, -1};
+    unsigned char split[MAX_ENTRY_SIZE]; // an entry that straddles two blocks
+    int splitHave = 0;
+    int blockIdx = cwd;
+    for (int blockStart = 0; blockStart < cwdLength; blockStart += blockSize()) {
+        if (blockStart > 0) {
+            blockIdx = getBlockEntry(blockIdx).value;
+            if (blockIdx < 0 || blockIdx == END_OF_FILE || blockIdx == UNALLOCATED) {
+                file_errno = EOTHER;
+                return addr;
+            }
+        }
+
+        const unsigned char *data = blockPin(blockIdx);
+        if (data == NULL) {
+            file_errno = EBADDEV;
+            printDevError("device err");
+            return addr;
+        }
+        int blockLength = _min(blockSize(), cwdLength - blockStart);
+
+        // Finish the entry carried over from the previous block
+        int pos = 0;
+        if (splitHave > 0) {
+            pos = mount->layout.entrySize - splitHave;
+            memcpy(split + splitHave, data, pos);
+            splitHave = 0;
+            if (_entryMatches(split, targetName, type)) {
+                addr = _getAddressFromDirectoryFile(split, mount->layout.entrySize, targetName, type);
+                addr.entryOffset = blockStart - mount->layout.entrySize + pos;
+                blockUnpin(data);
+                return addr;
+            }
+        }
+
+        int whole = pos + (blockLength - pos) / mount->layout.entrySize * mount->layout.entrySize;
+        addr = _getAddressFromDirectoryFile((unsigned char *)data + pos, whole - pos, targetName, type);
+        if (addr.startBlockIdx != -1) {
+            addr.entryOffset += blockStart + pos;
+            blockUnpin(data);
+            return addr;
+        }
+
+        splitHave = blockLength - whole;
+        memcpy(split, data + whole, splitHave);
+        blockUnpin(data);
+    }
+
+    // Not found
+    return addr;
+}
+
+/**
+ * @brief Get the DirectoryEntry from a directory, going through the dentry cache.
+ *
+ * @param cwd start index of the block containing the working directory file
+ * @param targetName file/directory name to retrieve the address for.
+ * @param type 'F' for file, 'D' for directory
+ * @return DirectoryEntry struct with all values -1 if not found, block index (address) and its length otherwise.
+ */
+struct DirectoryEntry _lookupEntry(int cwd, int cwdLength, unsigned char *targetName, char type) {
+    struct DirectoryEntry cached;
+    if (_dentryLookup(cwd, targetName, type, &cached)) {
+        return cached;
+    }
+
+    int savedErrno = file_errno;
+    file_errno = 0;
+    struct DirectoryEntry entry = getAddressFromDirectory(cwd, cwdLength, targetName, type);
+    if (file_errno == 0) {
+        // Only remember results that came from a successful read
+        _dentryStore(cwd, targetName, type, entry);
+        file_errno = savedErrno;
+    }
+    return entry;
+}
+
+/**
+ * @brief Reads the next section of a pathname into name.
+ *
+ * @param pathName full pathname
+ * @param pos index of the first character of the section, moved to the start of the following section.
+ * @param name buffer of at least 8 bytes, filled with the null terminated section.
+ * @return int 1 if this is the last section, 0 if more follow, -1 if the section is not 1 to 7 bytes long.
+ */
+int _nextSection(char *pathName, int *pos, unsigned char *name) {
+    int sectionLength = strcspn(pathName + *pos, "/");
+    if (sectionLength < 1 || sectionLength > 7) {
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    memcpy(name, pathName + *pos, sectionLength);
+    name[sectionLength] = '\0';
+
+    // A single trailing "/" still ends the pathname
+    char next = pathName[*pos + sectionLength];
+    int isLast = next == '\0' || (next == '/' && pathName[*pos + sectionLength + 1] == '\0');
+    *pos += sectionLength + 1;
+    return isLast;
+}
+
+/**
+ * @brief Looks an entry up in a directory with the directory locked for reading.
+ * A subdirectory found has its size recorded with its lock.
+ *
+ * @param dirBlock start block of the directory
+ * @param targetName
+ * @param type 'F' for file, 'D' for directory
+ * @param entry filled in with the entry, startBlockIdx -1 if it does not exist
+ * @param dirLength filled in with the size of the directory file, if not NULL
+ * @return int 0 for success, -1 for error.
+ */
+int _findEntry(int dirBlock, unsigned char *targetName, char type, struct DirectoryEntry *entry, int *dirLength) {
+    struct ChainLock *dir = _lockChain(dirBlock, 0);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int result = -1;
+    int length = _dirLength(dir);
+    if (length >= 0) {
+        *entry = _lookupEntry(dirBlock, length, targetName, type);
+        result = 0;
+        if (type == 'D' && entry->startBlockIdx != -1) {
+            result = _noteDirLength(entry->startBlockIdx, entry->filesize);
+        }
+    }
+    _unlockChain(dir);
+
+    if (dirLength != NULL) {
+        *dirLength = length;
+    }
+    return result;
+}
+
+/**
+ * @brief Resolves a full pathname by walking its directories down from the root.
+ * Every step goes through the dentry cache, so warm paths need no device reads.
+ * Each directory is locked for reading only while it is searched.
+ *
+ * @param pathName full pathname starting with "/"
+ * @param type 'F' for file, 'D' for directory - the type of the last section
+ * @param lookup filled in with the target entry (startBlockIdx -1 if it does not exist) and its parent
+ * @return int 0 if every intervening directory exists, -1 otherwise.
+ */
+int _resolvePath(char *pathName, char type, struct PathLookup *lookup) {
+    lookup->entry.startBlockIdx = -1;
+    lookup->entry.filesize = -1;
+    lookup->entry.entryOffset = -1;
+    lookup->parentBlockIdx = getRootIndex();
+    lookup->parentLength = -1;
+    lookup->name[0] = '\0';
+
+    if (pathName[0] != '/') {
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    int pos = 1;
+    while (1) {
+        int isLast = _nextSection(pathName, &pos, lookup->name);
+        if (isLast == -1) {
+            return -1;
+        }
+
+        struct DirectoryEntry found;
+        if (_findEntry(lookup->parentBlockIdx, lookup->name, isLast ? type : 'D', &found, &lookup->parentLength) != 0) {
+            return -1;
+        }
+
+        if (isLast) {
+            lookup->entry = found;
+            return 0;
+        }
+
+        // 'Navigate' to directory
+        if (found.startBlockIdx == -1) {
+            file_errno = ENOSUCHFILE;
+            return -1;
+        }
+        lookup->parentBlockIdx = found.startBlockIdx;
+    }
+}
+
+/**
+ * @brief Allocates a new block for the given file and makes the directory file entry.
+ *
+ * NOTE: Does not increase the size of the parent's directory size in grandparent directory file.
+ *
+ * @param fileName
+ * @param type
+ * @param parentDirBlock
+ * @param parentDirLength
+ * @return int
+ */
+int _createFile(unsigned char *fileName, unsigned char type, int parentDirBlock, int parentDirLength, int *newBlockIdx) {
+    // Allocate new block - a file in its directory's group, a directory in one picked by its name and parent
+    if (_loadFAT() != 0) {
+        return -1;
+    }
+    int group = _groupOf(parentDirBlock);
+    if (type == 'D') {
+        uint32_t hash = _fnv1a(FNV_OFFSET_BASIS, (unsigned char *)&parentDirBlock, sizeof(parentDirBlock));
+        group = _fnv1a(hash, fileName, strlen((char *)fileName)) % mount->freeMap.nGroups;
+    }
+    if (_allocateNewBlock(group, newBlockIdx) != 0) {
+        return -1;
+    }
+
+    // Append to directory file
+    unsigned char directoryEntry[MAX_ENTRY_SIZE] = {' ', ' ', ' ', ' ', ' ', ' ', ' '};
+    strncpy((char *)directoryEntry, (char *)fileName, 7);
+    // Set type
+    directoryEntry[7] = type;
+    // Set start block
+    _encode(*newBlockIdx, directoryEntry + 8);
+    // Set file size (initially 0)
+    _encode(0, directoryEntry + 8 + mount->layout.fieldSize);
+
+    if (_append(parentDirBlock, parentDirLength, directoryEntry, mount->layout.entrySize) != 0) {
+        return -1;
+    }
+
+    // Replaces any negative entry cached for this name
+    struct DirectoryEntry entry = {*newBlockIdx, 0, parentDirLength};
+    _dentryStore(parentDirBlock, fileName, type, entry);
+
+    return 0;
+}
+
+/**
+ * @brief Overwrites bytes already inside a file (e.g. a directory entry) in place.
+ * Follows the file's block chain, so the range may span non-contiguous blocks.
+ *
+ * @param startBlockIdx start block of the file
+ * @param offset byte offset within the file to start writing at
+ * @param data
+ * @param length
+ * @return int 0 for success, -1 for error.
+ */
+int _writeAt(int startBlockIdx, int offset, unsigned char *data, int length) {
+    int blockIdx = startBlockIdx;
+    int blockStart = 0;
+    int done = 0;
+
+    while (done < length) {
+        while (offset + done - blockStart >= blockSize()) {
+            blockIdx = getBlockEntry(blockIdx).value;
+            blockStart += blockSize();
+            if (blockIdx < 0 || blockIdx == END_OF_FILE || blockIdx == UNALLOCATED) {
+                file_errno = EOTHER;
+                return -1;
+            }
+        }
+
+        int blockPos = offset + done - blockStart;
+        int chunk = _min(blockSize() - blockPos, length - done);
+
+        unsigned char *buffer = blockPinMut(blockIdx);
+        if (buffer == NULL) {
+            file_errno = EBADDEV;
+            printDevError("device err");
+            return -1;
+        }
+        memcpy(buffer + blockPos, data + done, chunk);
+        if (blockUnpin(buffer)) {
+            file_errno = EBADDEV;
+            printDevError("device err");
+            return -1;
+        }
+        done += chunk;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Overwrites the filesize field of the entry at a given offset of a directory file.
+ *
+ * @param dirStartBlock start block of the directory file
+ * @param entryOffset byte offset of the entry within the directory file
+ * @param filesize
+ * @return int 0 for success, -1 for error.
+ */
+int _setEntryFilesize(int dirStartBlock, int entryOffset, int filesize) {
+    unsigned char field[4];
+    if (_encode(filesize, field) != 0) {
+        return -1;
+    }
+
+    return _writeAt(dirStartBlock, entryOffset + 8 + mount->layout.fieldSize, field, mount->layout.fieldSize);
+}
+
+int _updateFilesize(int dirStartBlock, int dirLength, unsigned char *targetName, char type, int filesize) {
+    struct DirectoryEntry entry = _lookupEntry(dirStartBlock, dirLength, targetName, type);
+    if (entry.startBlockIdx == -1) {
+        // Not found
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    if (_setEntryFilesize(dirStartBlock, entry.entryOffset, filesize) != 0) {
+        return -1;
+    }
+    _dentryUpdateSize(dirStartBlock, targetName, type, filesize);
+    return 0;
+}
+
+/**
+ * @brief Records a new size for a directory file, wherever its size is kept.
+ * The directory and the one holding its entry must be locked for writing.
+ *
+ * @param dirBlock start block of the directory
+ * @param parentBlock start block of the directory holding its entry (ignored for the root)
+ * @param parentLength size of that directory file
+ * @param dirName name of the directory
+ * @param size new size of the directory file
+ * @return int 0 for success, -1 for error.
+ */
+int _setDirectorySize(int dirBlock, int parentBlock, int parentLength, unsigned char *dirName, int size) {
+    // If it is root, we know where filesize is.
+    if (dirBlock == getRootIndex()) {
+        return _setRootSize(size);
+    }
+    if (_updateFilesize(parentBlock, parentLength, dirName, 'D', size) != 0) {
+        return -1;
+    }
+    return _noteDirLength(dirBlock, size);
+}
+
+/**
+ * @brief Finds the subtree table slot for a directory (its own or the empty one it would go in).
+ */
+struct SubtreeSize *_subtreeSlot(int dirBlockIdx) {
+    if (mount->subtreeSizes.capacity == 0) {
+        return NULL;
+    }
+
+    int i = (uint32_t)dirBlockIdx * 2654435761u & (mount->subtreeSizes.capacity - 1);
+    while (mount->subtreeSizes.slots[i].dirBlockIdx != 0 && mount->subtreeSizes.slots[i].dirBlockIdx != dirBlockIdx) {
+        i = (i + 1) & (mount->subtreeSizes.capacity - 1);
+    }
+    return &mount->subtreeSizes.slots[i];
+}
+
+/**
+ * @brief Records the subtree size of a directory, growing the table when it is half full.
+ * subtreeLock must be held.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int _setSubtreeSize(int dirBlockIdx, int parentBlockIdx, int size) {
+    if (2 * (mount->subtreeSizes.count + 1) > mount->subtreeSizes.capacity) {
+        struct SubtreeTable old = mount->subtreeSizes;
+        mount->subtreeSizes.capacity = (old.capacity == 0) ? 64 : old.capacity * 2;
+        mount->subtreeSizes.slots = calloc(mount->subtreeSizes.capacity, sizeof(struct SubtreeSize));
+        mount->subtreeSizes.count = 0;
+        if (mount->subtreeSizes.slots == NULL) {
+            mount->subtreeSizes = old;
+            file_errno = EOTHER;
+            return -1;
+        }
+        for (int i = 0; i < old.capacity; i++) {
+            if (old.slots[i].dirBlockIdx != 0) {
+                *_subtreeSlot(old.slots[i].dirBlockIdx) = old.slots[i];
+                mount->subtreeSizes.count++;
+            }
+        }
+        free(old.slots);
+    }
+
+    struct SubtreeSize *slot = _subtreeSlot(dirBlockIdx);
+    if (slot->dirBlockIdx == 0) {
+        mount->subtreeSizes.count++;
+    }
+    slot->dirBlockIdx = dirBlockIdx;
+    slot->parentBlockIdx = parentBlockIdx;
+    slot->size = size;
+    return 0;
+}
+
+/**
+ * @brief Gets the size of a directory's subtree - its DMS plus every file and directory below it.
+ * Computed recursively the first time, then answered from the subtree table.
+ * Each directory is read a batch of entries at a time through a block cursor, and no lock is held
+ * while its subdirectories are added up, so memory use depends on the depth of the tree only.
+ *
+ * @param dirAddr start block of the directory
+ * @param dirLength size of its DMS, as last seen in its entry
+ * @param parentAddr start block of the directory holding it (-1 for the root)
+ * @return int size, or -1 on error.
+ */
+int _getDirectorySize(int dirAddr, int dirLength, int parentAddr) {
+    pthread_mutex_lock(&mount->subtreeLock);
+    struct SubtreeSize *cached = _subtreeSlot(dirAddr);
+    int size = (cached != NULL && cached->dirBlockIdx == dirAddr) ? cached->size : -1;
+    int quiet = mount->subtreeSizes.writers == 0;
+    unsigned epoch = mount->subtreeSizes.epoch;
+    pthread_mutex_unlock(&mount->subtreeLock);
+    if (size >= 0) {
+        return size;
+    }
+
+    // Size the request dir with its lock held, so the size recorded with it (if any) is current
+    struct ChainLock *dir = _lockChain(dirAddr, 0);
+    if (dir == NULL) {
+        return -1;
+    }
+    if (dirAddr == getRootIndex() || __atomic_load_n(&dir->length, __ATOMIC_RELAXED) >= 0) {
+        dirLength = _dirLength(dir);
+    }
+    _unlockChain(dir);
+    if (dirLength < 0) {
+        return -1;
+    }
+
+    int sum = dirLength;
+    unsigned char batch[DIR_BATCH_ENTRIES * MAX_ENTRY_SIZE];
+    struct BlockCursor cursor = {-1, 0};
+    for (int position = 0; position < dirLength;) {
+        int length = _min(dirLength - position, DIR_BATCH_ENTRIES * mount->layout.entrySize);
+        if ((dir = _lockChain(dirAddr, 0)) == NULL) {
+            return -1;
+        }
+        int failed = _readAt(dirAddr, position, length, batch, &cursor);
+        _unlockChain(dir);
+        if (failed) {
+            file_errno = EOTHER;
+            return -1;
+        }
+
+        for (int i = 0; i < length; i += mount->layout.entrySize) {
+            if (batch[i + 7] == 'I') {
+                continue; // hashed index, not a child
+            } else if (batch[i + 7] == 'D') {
+                int childSize = _getDirectorySize(_entryStartBlock(batch + i), _entryFilesize(batch + i), dirAddr);
+                if (childSize < 0) {
+                    return -1;
+                }
+                sum += childSize;
+            } else {
+                sum += _entryFilesize(batch + i);
+            }
+        }
+        position += length;
+    }
+
+    // Only remembered if no change was under way while it was added up
+    pthread_mutex_lock(&mount->subtreeLock);
+    int result = 0;
+    if (quiet && mount->subtreeSizes.writers == 0 && mount->subtreeSizes.epoch == epoch) {
+        result = _setSubtreeSize(dirAddr, parentAddr, sum);
+    }
+    pthread_mutex_unlock(&mount->subtreeLock);
+    return (result == 0) ? sum : -1;
+}
+
+/**
+ * @brief Adds to the subtree size of a directory and each of its ancestors, with subtreeLock held.
+ * Nothing to do for directories not in the table, as none of their ancestors are either.
+ */
+void _addSubtreeBytes(int dirBlockIdx, int delta) {
+    while (dirBlockIdx != -1) {
+        struct SubtreeSize *slot = _subtreeSlot(dirBlockIdx);
+        if (slot == NULL || slot->dirBlockIdx != dirBlockIdx) {
+            return;
+        }
+        slot->size += delta;
+        dirBlockIdx = slot->parentBlockIdx;
+    }
+}
+
+/**
+ * @brief Starts a change to the size of a file or directory, finished by _subtreeEnd.
+ */
+void _subtreeBegin() {
+    pthread_mutex_lock(&mount->subtreeLock);
+    mount->subtreeSizes.writers++;
+    pthread_mutex_unlock(&mount->subtreeLock);
+}
+
+/**
+ * @brief Finishes a change started by _subtreeBegin, which added delta bytes below a directory.
+ * A new subdirectory of it (-1 for none) joins the table if the directory is in it.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int _subtreeEnd(int dirBlockIdx, int delta, int newDirBlockIdx) {
+    pthread_mutex_lock(&mount->subtreeLock);
+    int result = 0;
+    struct SubtreeSize *cached = _subtreeSlot(dirBlockIdx);
+    if (newDirBlockIdx != -1 && cached != NULL && cached->dirBlockIdx == dirBlockIdx) {
+        result = _setSubtreeSize(newDirBlockIdx, dirBlockIdx, 0);
+    }
+    _addSubtreeBytes(dirBlockIdx, delta);
+    mount->subtreeSizes.writers--;
+    mount->subtreeSizes.epoch++;
+    pthread_mutex_unlock(&mount->subtreeLock);
+    return result;
+}
+
+/**
+ * @brief Writes a new hashed index file for a directory.
+ * The index is a table of slots the size of the layout's fields (2 bytes for 'WFS'/'WFL2',
+ * 4 for 'WF2'/'WFL4'), each holding an entry number + 1 (0 for empty), placed by hashing
+ * the entry's name and type with linear probing.
+ *
+ * @param dirBlock start block of the directory
+ * @param dirLength size of the directory file
+ * @param capacity number of slots, a power of 2
+ * @param index filled in with the new index file's start block and size
+ * @return int 0 for success, -1 for error.
+ */
+int _writeDirIndex(int dirBlock, int dirLength, int capacity, struct DirectoryEntry *index) {
+    unsigned char *data = malloc(dirLength);
+    unsigned char *table = calloc(capacity, mount->layout.fieldSize);
+    if (data == NULL || table == NULL || _read(dirBlock, dirLength, 0, data) != 0) {
+        file_errno = EOTHER;
+        free(data);
+        free(table);
+        return -1;
+    }
+
+    for (int i = 0; i < dirLength; i += mount->layout.entrySize) {
+        if (data[i + 7] == 'I') {
+            continue;
+        }
+
+        int slot = _fnv1a(FNV_OFFSET_BASIS, data + i, 8) & (capacity - 1);
+        while (_getRaw(table + slot * mount->layout.fieldSize) != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        _encode(i / mount->layout.entrySize + 1, table + slot * mount->layout.fieldSize);
+    }
+    free(data);
+
+    int startBlockIdx;
+    if (_allocateNewBlock(_groupOf(dirBlock), &startBlockIdx) != 0 || _append(startBlockIdx, 0, table, capacity * mount->layout.fieldSize) != 0) {
+        free(table);
+        return -1;
+    }
+    free(table);
+
+    index->startBlockIdx = startBlockIdx;
+    index->filesize = capacity * mount->layout.fieldSize;
+    index->entryOffset = 0;
+    return 0;
+}
+
+/**
+ * @brief Points the index entry (offset 0) of a directory at a new index file.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int _setDirIndexEntry(int dirBlock, struct DirectoryEntry index) {
+    unsigned char fields[8];
+    if (_encode(index.startBlockIdx, fields) != 0 || _encode(index.filesize, fields + mount->layout.fieldSize) != 0) {
+        return -1;
+    }
+
+    if (_writeAt(dirBlock, 8, fields, 2 * mount->layout.fieldSize) != 0) {
+        return -1;
+    }
+    _dentryStore(dirBlock, (unsigned char *)"", 'I', index);
+    return 0;
+}
+
+/**
+ * @brief Updates cached references (dentries and open handles) to an entry that moved within its directory.
+ */
+void _moveEntryRefs(int dirBlock, int oldOffset, int newOffset) {
+    pthread_mutex_lock(&mount->dentryLock);
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        if (mount->dentryCache[i].valid && mount->dentryCache[i].parentBlockIdx == dirBlock && mount->dentryCache[i].entry.startBlockIdx != -1 &&
+            mount->dentryCache[i].entry.entryOffset == oldOffset) {
+            mount->dentryCache[i].entry.entryOffset = newOffset;
+        }
+    }
+    pthread_mutex_unlock(&mount->dentryLock);
+
+    pthread_mutex_lock(&mount->handleLock);
+    for (int i = 0; i < MAX_HANDLES; i++) {
+        if (mount->handles[i].inUse && mount->handles[i].parentBlockIdx == dirBlock && mount->handles[i].entryOffset == oldOffset) {
+            mount->handles[i].entryOffset = newOffset;
+        }
+    }
+    pthread_mutex_unlock(&mount->handleLock);
+}
+
+/**
+ * @brief Keeps a directory's hashed index in step after an entry has been appended to it.
+ *
+ * Once a directory reaches DIR_INDEX_THRESHOLD entries, its first entry is moved to the end
+ * and replaced by a hidden index entry (type 'I') pointing at the index file. After that each
+ * new entry is inserted into the index, which is rebuilt at double size when over half full.
+ *
+ * @param dirBlock start block of the directory
+ * @param dirLength size of the directory file, including the new entry
+ * @param key name and type of the new entry
+ * @param parentBlock start block of the directory holding this directory's entry (ignored for the root)
+ * @param parentLength size of that directory file
+ * @param dirName name of this directory
+ * @return int the directory's size afterwards (building the index adds an entry), -1 on error.
+ */
+int _indexNewEntry(int dirBlock, int dirLength, unsigned char *key, int parentBlock, int parentLength, unsigned char *dirName) {
+    int nEntries = dirLength / mount->layout.entrySize;
+    if (nEntries < DIR_INDEX_THRESHOLD) {
+        return dirLength;
+    }
+
+    struct DirectoryEntry index = _getDirIndex(dirBlock);
+    if (index.startBlockIdx != -1) {
+        int capacity = index.filesize / mount->layout.fieldSize;
+
+        if (2 * nEntries > capacity) {
+            // Grow - rebuild at double size and free the old table
+            struct DirectoryEntry newIndex;
+            if (_writeDirIndex(dirBlock, dirLength, capacity * 2, &newIndex) != 0 || _setDirIndexEntry(dirBlock, newIndex) != 0) {
+                return -1;
+            }
+            if (_freeChain(index.startBlockIdx) != 0) {
+                return -1;
+            }
+            return dirLength;
+        }
+
+        // Insert into the first free slot
+        int slot = _fnv1a(FNV_OFFSET_BASIS, key, 8) & (capacity - 1);
+        for (int probe = 0; probe < capacity; probe++) {
+            unsigned char field[4];
+            if (_readAt(index.startBlockIdx, slot * mount->layout.fieldSize, mount->layout.fieldSize, field, NULL) != 0) {
+                return -1;
+            }
+            if (_getRaw(field) == 0) {
+                _encode(nEntries, field); // ordinal of the last entry + 1
+                if (_writeAt(index.startBlockIdx, slot * mount->layout.fieldSize, field, mount->layout.fieldSize) != 0) {
+                    return -1;
+                }
+                return dirLength;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    // Build - move the first entry to the end so the index entry can take its place.
+    unsigned char first[MAX_ENTRY_SIZE];
+    if (_readAt(dirBlock, 0, mount->layout.entrySize, first, NULL) != 0 || _append(dirBlock, dirLength, first, mount->layout.entrySize) != 0) {
+        return -1;
+    }
+    _moveEntryRefs(dirBlock, 0, dirLength);
+    dirLength += mount->layout.entrySize;
+    if (_setDirectorySize(dirBlock, parentBlock, parentLength, dirName, dirLength) != 0) {
+        return -1;
+    }
+
+    unsigned char indexEntry[MAX_ENTRY_SIZE] = {'\0'};
+    indexEntry[7] = 'I';
+    if (_writeAt(dirBlock, 0, indexEntry, mount->layout.entrySize) != 0) {
+        return -1;
+    }
+
+    int capacity = 1;
+    while (capacity < 4 * nEntries) {
+        capacity *= 2;
+    }
+    if (_writeDirIndex(dirBlock, dirLength, capacity, &index) != 0 || _setDirIndexEntry(dirBlock, index) != 0) {
+        return -1;
+    }
+
+    return dirLength;
+}
+
+/**
+ * @brief Creates a file or directory entry in a directory, recording the directory's new size.
+ *
+ * @param name
+ * @param type 'F' for file, 'D' for directory
+ * @param dirBlock start block of the directory
+ * @param dirLength size of the directory file - updated on success.
+ * @param parentBlock start block of the directory holding this directory's entry (ignored for the root)
+ * @param parentLength size of that directory file
+ * @param dirName name of this directory
+ * @param newBlockIdx filled in with the new file's start block
+ * @return int 0 for success, -1 for error.
+ */
+int _addEntry(unsigned char *name, unsigned char type, int dirBlock, int *dirLength, int parentBlock, int parentLength,
+              unsigned char *dirName, int *newBlockIdx) {
+    _subtreeBegin();
+    int newLength = -1;
+
+    // We must update the parent's dir file to increase the filesize record of this directory
+    if (_createFile(name, type, dirBlock, *dirLength, newBlockIdx) == 0 &&
+        _setDirectorySize(dirBlock, parentBlock, parentLength, dirName, *dirLength + mount->layout.entrySize) == 0) {
+        unsigned char key[8];
+        _makeKey(key, name, type);
+        newLength = _indexNewEntry(dirBlock, *dirLength + mount->layout.entrySize, key, parentBlock, parentLength, dirName);
+    }
+
+    // A new (empty) subdirectory joins the table if its parent is in it.
+    int newDir = (newLength >= 0 && type == 'D') ? *newBlockIdx : -1;
+    if (_subtreeEnd(dirBlock, (newLength >= 0) ? newLength - *dirLength : 0, newDir) != 0 || newLength < 0) {
+        return -1;
+    }
+
+    *dirLength = newLength;
+    return 0;
+}
+
+/**
+ * @brief Finds an entry in a directory, creating it if it is not there.
+ * The directory is searched locked for reading, and only locked for writing, together with
+ * the directory holding its entry (where its size is recorded), if the entry has to be created.
+ *
+ * @param name
+ * @param type 'F' for file, 'D' for directory
+ * @param dirBlock start block of the directory
+ * @param parentBlock start block of the directory holding this directory's entry (-1 for the root)
+ * @param dirName name of this directory
+ * @param entry filled in with the entry found or created
+ * @return int 1 if the entry was created, 0 if it was already there, -1 for error.
+ */
+int _findOrAddEntry(unsigned char *name, unsigned char type, int dirBlock, int parentBlock, unsigned char *dirName,
+                    struct DirectoryEntry *entry) {
+    if (_findEntry(dirBlock, name, type, entry, NULL) != 0) {
+        return -1;
+    }
+    if (entry->startBlockIdx != -1) {
+        return 0;
+    }
+
+    // Look again once locked, another thread may have created it in the meantime
+    struct ChainLock *dir = _lockChain(dirBlock, 1);
+    if (dir == NULL) {
+        return -1;
+    }
+    struct ChainLock *parent = NULL;
+    if (parentBlock != -1 && (parent = _lockChain(parentBlock, 1)) == NULL) {
+        _unlockChain(dir);
+        return -1;
+    }
+
+    int result = -1;
+    int dirLength = _dirLength(dir);
+    int parentLength = (parent == NULL) ? 0 : _dirLength(parent);
+    if (dirLength >= 0 && parentLength >= 0) {
+        *entry = _lookupEntry(dirBlock, dirLength, name, type);
+        result = 0;
+        if (entry->startBlockIdx == -1) {
+            result = _addEntry(name, type, dirBlock, &dirLength, parentBlock, parentLength, dirName, &entry->startBlockIdx);
+            entry->filesize = 0;
+            result = (result == 0) ? 1 : -1;
+        }
+        if (result >= 0 && type == 'D' && _noteDirLength(entry->startBlockIdx, entry->filesize) != 0) {
+            result = -1;
+        }
+    }
+
+    _unlockChain(parent);
+    _unlockChain(dir);
+    return result;
+}
+
+/*
+ * Makes a file with a fully qualified pathname starting with "/".
+ * It automatically creates all intervening directories.
+ * Pathnames can consist of any printable ASCII characters (0x20 - 0x7e)
+ * including the space character.
+ * The occurrence of "/" is interpreted as starting a new directory
+ * (or the file name).
+ * Each section of the pathname must be between 1 and 7 bytes long (not
+ * counting the "/"s).
+ * The pathname cannot finish with a "/" so the only way to create a directory
+ * is to create a file in that directory. This is not true for the root
+ * directory "/" as this needs to be created when format is called.
+ * The total length of a pathname is limited only by the size of the device.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int create(char *pathName) {
+    if (pathName[0] != '/') {
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    unsigned char nameBuffer[8];
+    int cwdAddress = getRootIndex();
+
+    unsigned char parentNameBuffer[8] = {'\0'};
+    int cwdParentAddress = -1; // Start block number of cwd parent
+
+    // Navigate and create requested directories.
+    int pos = 1;
+    int isLast;
+    while ((isLast = _nextSection(pathName, &pos, nameBuffer)) == 0) {
+        // (Create if necessary and) Navigate to the directory specified.
+        struct DirectoryEntry newDirAddr;
+        if (_findOrAddEntry(nameBuffer, 'D', cwdAddress, cwdParentAddress, parentNameBuffer, &newDirAddr) < 0) {
+            return -1;
+        }
+
+        // 'Navigate' to directory
+        cwdParentAddress = cwdAddress;
+        cwdAddress = newDirAddr.startBlockIdx;
+        memcpy(parentNameBuffer, nameBuffer, 8);
+    }
+
+    if (isLast == -1) {
+        return -1;
+    }
+
+    // File creation requested, create file unless it already exists.
+    struct DirectoryEntry file;
+    int created = _findOrAddEntry(nameBuffer, 'F', cwdAddress, cwdParentAddress, parentNameBuffer, &file);
+    if (created < 0) {
+        return -1;
+    }
+    if (created == 0) {
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    // Create file pointer
+    pthread_mutex_lock(&mount->filePointerLock);
+    if (_reserveFilePointers() != 0) {
+        pthread_mutex_unlock(&mount->filePointerLock);
+        return -1;
+    }
+    mount->filePointers[mount->nOpenFiles].startBlockIdx = file.startBlockIdx;
+    mount->filePointers[mount->nOpenFiles].offset = 0;
+    mount->filePointers[mount->nOpenFiles].cursor.blockIdx = -1;
+
+    mount->nOpenFiles++;
+    pthread_mutex_unlock(&mount->filePointerLock);
+    return _flushFAT();
+}
+
+/**
+ * @brief Gets the open directory iterator with the given number.
+ *
+ * @return struct DirHandle* or NULL (with file_errno set) if it is not open.
+ */
+struct DirHandle *_getDirHandle(int handle) {
+    pthread_mutex_lock(&mount->handleLock);
+    int open = handle >= 0 && handle < MAX_DIR_HANDLES && mount->dirHandles[handle].inUse;
+    pthread_mutex_unlock(&mount->handleLock);
+    if (!open) {
+        file_errno = EOTHER;
+        return NULL;
+    }
+    return &mount->dirHandles[handle];
+}
+
+/*
+ * Opens a directory so its entries can be read one at a time with fsReadDir.
+ * The directoryName is a full pathname, "/" for the root.
+ * Returns the directory handle (>= 0) if no problem or -1 if the call failed.
+ */
+int fsOpenDir(char *directoryName) {
+    int dirBlockIdx = getRootIndex();
+    int parentBlockIdx = -1;
+    int length = _getRootSize();
+    if (length < 0) {
+        return -1;
+    }
+
+    // Navigate to requested directory (unless it is the root).
+    if (directoryName[0] != '/' || directoryName[1] != '\0') {
+        struct PathLookup lookup;
+        if (_resolvePath(directoryName, 'D', &lookup) != 0) {
+            return -1;
+        }
+        if (lookup.entry.startBlockIdx == -1) {
+            file_errno = ENOSUCHFILE;
+            return -1;
+        }
+        dirBlockIdx = lookup.entry.startBlockIdx;
+        parentBlockIdx = lookup.parentBlockIdx;
+        length = lookup.entry.filesize;
+    }
+
+    pthread_mutex_lock(&mount->handleLock);
+    for (int i = 0; i < MAX_DIR_HANDLES; i++) {
+        if (!mount->dirHandles[i].inUse) {
+            mount->dirHandles[i].inUse = 1;
+            pthread_mutex_unlock(&mount->handleLock);
+            mount->dirHandles[i].dirBlockIdx = dirBlockIdx;
+            mount->dirHandles[i].parentBlockIdx = parentBlockIdx;
+            mount->dirHandles[i].length = length;
+            mount->dirHandles[i].position = 0;
+            mount->dirHandles[i].cursor.blockIdx = -1;
+            mount->dirHandles[i].cursor.blockStart = 0;
+            mount->dirHandles[i].batchStart = -1;
+            mount->dirHandles[i].batchLength = 0;
+            return i;
+        }
+    }
+    pthread_mutex_unlock(&mount->handleLock);
+
+    // Handle table full
+    file_errno = EOTHER;
+    return -1;
+}
+
+/*
+ * Reads the next entry of an open directory into entry.
+ * The size of a subdirectory is the total size of everything below it.
+ * Returns 1 if an entry was read, 0 at the end of the directory or -1 if the call failed.
+ */
+int fsReadDir(int handle, struct DirEntry *entry) {
+    struct DirHandle *dh = _getDirHandle(handle);
+    if (dh == NULL) {
+        return -1;
+    }
+
+    while (dh->position < dh->length) {
+        // Refill the batch once it has been used up
+        if (dh->batchStart < 0 || dh->position >= dh->batchStart + dh->batchLength) {
+            int length = _min(dh->length - dh->position, DIR_BATCH_ENTRIES * mount->layout.entrySize);
+            struct ChainLock *dir = _lockChain(dh->dirBlockIdx, 0);
+            if (dir == NULL) {
+                return -1;
+            }
+            int failed = _readAt(dh->dirBlockIdx, dh->position, length, dh->batch, &dh->cursor);
+            _unlockChain(dir);
+            if (failed) {
+                return -1;
+            }
+            dh->batchStart = dh->position;
+            dh->batchLength = length;
+        }
+
+        unsigned char *data = dh->batch + (dh->position - dh->batchStart);
+        dh->position += mount->layout.entrySize;
+        if (data[7] == 'I') {
+            continue; // hashed index, not a child
+        }
+
+        memcpy(entry->name, data, 7);
+        entry->name[7] = '\0';
+        entry->type = data[7];
+        entry->startBlock = _entryStartBlock(data);
+        entry->size = _entryFilesize(data);
+        if (entry->type == 'D') {
+            entry->size = _getDirectorySize(entry->startBlock, entry->size, dh->dirBlockIdx);
+            if (entry->size < 0) {
+                return -1;
+            }
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Closes a handle returned by fsOpenDir.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int fsCloseDir(int handle) {
+    struct DirHandle *dh = _getDirHandle(handle);
+    if (dh == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mount->handleLock);
+    dh->inUse = 0;
+    pthread_mutex_unlock(&mount->handleLock);
+    return 0;
+}
+
+/*
+ * Returns a list of all files in the named directory.
+ * The "result" string is filled in with the output.
+ * The result looks like this
+
+/dir1:
+file1	42
+file2	0
+
+ * The fully qualified pathname of the directory followed by a colon and
+ * then each file name followed by a tab "\t" and then its file size.
+ * Each file on a separate line.
+ * The directoryName is a full pathname.
+ * Returns 0 if no problem or -1 if the call failed, leaving the entries listed so far.
+ */
+int list(char *result, char *directoryName) {
+    result[0] = '\0';
+    int handle = fsOpenDir(directoryName);
+    if (handle < 0) {
+        return -1;
+    }
+
+    // Print dir contents, appending at the end of what has been written so far
+    char *end = result + sprintf(result, "%s:\n", directoryName);
+    struct DirEntry entry;
+    int found;
+    while ((found = fsReadDir(handle, &entry)) == 1) {
+        end += sprintf(end, "%s:\t%i\n", entry.name, entry.size); // each file on newline
+    }
+
+    fsCloseDir(handle);
+    return (found == 0) ? 0 : -1;
+}
+
+/**
+ * @brief Updates the filesize recorded in every open handle of a file after it grows.
+ */
+void _syncHandleSizes(int startBlockIdx, int filesize) {
+    pthread_mutex_lock(&mount->handleLock);
+    for (int i = 0; i < MAX_HANDLES; i++) {
+        if (mount->handles[i].inUse && mount->handles[i].startBlockIdx == startBlockIdx) {
+            mount->handles[i].filesize = filesize;
+        }
+    }
+    pthread_mutex_unlock(&mount->handleLock);
+}
 
 /**
- * @brief Allocates a new block for the given file and makes the directory file entry.
- *
- * NOTE: Does not increase the size of the parent's directory size in grandparent directory file.
+ * @brief Records the new size of a file that has grown by delta bytes, for a caller holding the file's lock for writing.
+ * The entry is changed with the directory holding it locked for writing.
  *
- * @param fileName
- * @param type
- * @param parentDirBlock
- * @param parentDirLength
- * @return int
+ * @param startBlockIdx start block of the file
+ * @param parentBlockIdx start block of the directory holding its entry
+ * @param name name of the file
+ * @param fh handle that knows where the entry is, NULL to look it up by name
+ * @param filesize new size
+ * @param delta bytes added
+ * @return int 0 for success, -1 for error.
  */
-int _createFile(unsigned char *fileName, unsigned char type, int parentDirBlock, int parentDirLength, int *newBlockIdx) {
-    // Allocate new block
-    if (_allocateNewBlock(-1, newBlockIdx) != 0) {
-        return -1;
+int _recordGrowth(int startBlockIdx, int parentBlockIdx, unsigned char *name, struct FileHandle *fh, int filesize, int delta) {
+    _subtreeBegin();
+    int result = -1;
+    struct ChainLock *dir = _lockChain(parentBlockIdx, 1);
+    if (dir != NULL && fh != NULL) {
+        pthread_mutex_lock(&mount->handleLock);
+        int entryOffset = fh->entryOffset;
+        pthread_mutex_unlock(&mount->handleLock);
+        result = _setEntryFilesize(parentBlockIdx, entryOffset, filesize);
+        if (result == 0) {
+            _dentryUpdateSize(parentBlockIdx, name, 'F', filesize);
+        }
+    } else if (dir != NULL) {
+        int dirLength = _dirLength(dir);
+        result = (dirLength < 0) ? -1 : _updateFilesize(parentBlockIdx, dirLength, name, 'F', filesize);
     }
+    _unlockChain(dir);
 
-    // Append to directory file
-    unsigned char directoryEntry[12] = {' ', ' ', ' ', ' ', ' ', ' ', ' '};
-    strncpy((char *)directoryEntry, (char *)fileName, 7);
-    // Set type
-    directoryEntry[7] = type;
-    // Set start block
-    unsigned char encoded[2];
-    _encode(*newBlockIdx, encoded);
-    directoryEntry[8] = encoded[1];
-    directoryEntry[9] = encoded[0];
-    // Set file size (initially 0)
-    directoryEntry[10] = (unsigned char)0;
-    directoryEntry[11] = (unsigned char)0;
+    if (result == 0) {
+        _syncHandleSizes(startBlockIdx, filesize);
+    }
+    _subtreeEnd(parentBlockIdx, (result == 0) ? delta : 0, -1);
+    return result;
+}
+
+/*
+ * Writes data onto the end of the file.
+ * Copies "length" bytes from data and appends them to the file.
+ * The filename is a full pathname.
+ * The file must have been created before this call is made.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int a2write(char *fileName, void *data, int length) {
+    struct PathLookup lookup;
+    if (_resolvePath(fileName, 'F', &lookup) != 0) {
+        return -5;
+    }
+
+    struct DirectoryEntry file = lookup.entry;
+    if (file.startBlockIdx == -1) {
+        file_errno = ENOSUCHFILE;
+        return -3;
+    }
+
+    // Writers to the file take turns, each reading its size again once it has the lock
+    struct ChainLock *fileLock = _lockChain(file.startBlockIdx, 1);
+    if (fileLock == NULL) {
+        return -2;
+    }
+    if (_findEntry(lookup.parentBlockIdx, lookup.name, 'F', &file, NULL) != 0) {
+        _unlockChain(fileLock);
+        return -2;
+    }
+
+    // File exists, append data if the size field can still hold the result
+    if (length > _maxFilesize() - file.filesize) {
+        _unlockChain(fileLock);
+        file_errno = ENOROOM;
+        return -2;
+    }
+    if (_append(file.startBlockIdx, file.filesize, data, length) != 0) {
+        _unlockChain(fileLock);
+        return -2;
+    }
+
+    // Update file size for file
+    if (_recordGrowth(file.startBlockIdx, lookup.parentBlockIdx, lookup.name, NULL, file.filesize + length, length) != 0) {
+        _unlockChain(fileLock);
+        return -2;
+    }
+    _unlockChain(fileLock);
+
+    return _flushFAT();
+}
+
+/*
+ * Reads data from the start of the file.
+ * Maintains a file position so that subsequent reads continue
+ * from where the last read finished.
+ * The filename is a full pathname.
+ * The file must have been created before this call is made.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int a2read(char *fileName, void *data, int length) {
+    pthread_mutex_lock(&mount->filePointerLock);
+    if (mount->nOpenFiles == 0) {
+        regenerateFilePointers();
+    }
+    pthread_mutex_unlock(&mount->filePointerLock);
+
+    if (length == 0) {
+        return 0;
+    }
 
-    if (_append(parentDirBlock, parentDirLength, directoryEntry, 12) != 0) {
+    struct PathLookup lookup;
+    if (_resolvePath(fileName, 'F', &lookup) != 0) {
+        return -3;
+    }
+
+    struct DirectoryEntry fileMetadata = lookup.entry;
+    if (fileMetadata.startBlockIdx == -1) {
+        file_errno = ENOSUCHFILE;
         return -1;
     }
 
+    struct ChainLock *fileLock = _lockChain(fileMetadata.startBlockIdx, 0);
+    if (fileLock == NULL) {
+        return -5;
+    }
+
+    int offset = 0;
+    int fpIdx = -1;
+    struct BlockCursor cursor;
+    // Check for any file pointers, claiming the bytes read so threads sharing it read one after another
+    pthread_mutex_lock(&mount->filePointerLock);
+    for (int i = 0; i < mount->nOpenFiles; i++) {
+        if (mount->filePointers[i].startBlockIdx == fileMetadata.startBlockIdx) {
+
+            offset = mount->filePointers[i].offset;
+            fpIdx = i;
+        }
+    }
+    if (fpIdx >= 0) {
+        cursor = mount->filePointers[fpIdx].cursor;
+        mount->filePointers[fpIdx].offset = offset + length;
+    }
+    pthread_mutex_unlock(&mount->filePointerLock);
+
+    // Continue from the block the previous read finished in
+    int failed = _readAt(fileMetadata.startBlockIdx, offset, length, data, (fpIdx < 0) ? NULL : &cursor);
+    _unlockChain(fileLock);
+
+    // Update file pointer, unless another read or a seek has moved it since
+    if (fpIdx >= 0) {
+        pthread_mutex_lock(&mount->filePointerLock);
+        if (mount->filePointers[fpIdx].offset == offset + length) {
+            if (failed) {
+                mount->filePointers[fpIdx].offset = offset;
+            } else {
+                mount->filePointers[fpIdx].cursor = cursor;
+            }
+        }
+        pthread_mutex_unlock(&mount->filePointerLock);
+    }
+
+    if (failed) {
+        return -5;
+    }
+    if (fpIdx < 0) {
+        file_errno = EOTHER;
+        return -2;
+    }
+
     return 0;
 }
 
-int _updateFilesize(int dirStartBlock, int dirLength, unsigned char *targetName, char type, int filesize) {
-    // Read directory
-    unsigned char *data = malloc(dirLength);
-    if (_read(dirStartBlock, dirLength, 0, data) != 0) {
-        file_errno = EOTHER;
-        free(data);
+/*
+ * Repositions the file pointer for the file at the specified location.
+ * All positive integers are byte offsets from the start of the file.
+ * 0 is the beginning of the file.
+ * If the location is after the end of the file, move the location
+ * pointer to the end of the file.
+ * The filename is a full pathname.
+ * The file must have been created before this call is made.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int seek(char *fileName, int location) {
+    pthread_mutex_lock(&mount->filePointerLock);
+    if (mount->nOpenFiles == 0) {
+        regenerateFilePointers();
+    }
+    pthread_mutex_unlock(&mount->filePointerLock);
+    struct PathLookup lookup;
+    if (_resolvePath(fileName, 'F', &lookup) != 0) {
         return -1;
     }
 
-    // Get target
-    char target[9];
-    strncpy(target, (char *)targetName, 7);
-    target[7] = type;
+    struct DirectoryEntry fileMetadata = lookup.entry;
+    if (fileMetadata.startBlockIdx == -1) {
+        file_errno = ENOSUCHFILE;
+        return -1;
+    }
 
-    // Parse & search
-    for (int i = 0; i < dirLength; i += 12) {
-        if (strncmp(target, (char *)data + i, 8) == 0) {
-            // Found target file/directory - calculate block & offset
-            unsigned char encoded[2];
-            _encode(filesize, encoded);
-
-            int c1_block = dirStartBlock + (i + 10) / BLOCK_SIZE;
-            int c1_offset = (i + 10) % BLOCK_SIZE;
-
-            int c0_block = dirStartBlock + (i + 11) / BLOCK_SIZE;
-            int c0_offset = (i + 11) % BLOCK_SIZE;
-
-            // Make change
-            // Modify C1
-            unsigned char readBuffer[BLOCK_SIZE];
-            if (blockRead(c1_block, readBuffer) == -1) {
-                file_errno = EBADDEV;
-                printDevError("device err");
-                free(data);
-                return -1;
+    // Edit file pointer
+    pthread_mutex_lock(&mount->filePointerLock);
+    for (int i = 0; i < mount->nOpenFiles; i++) {
+        // struct FilePointer fp = ;
+        if (mount->filePointers[i].startBlockIdx == fileMetadata.startBlockIdx) {
+            // Set location to EoF if too large
+            if (location > fileMetadata.filesize) {
+                mount->filePointers[i].offset = fileMetadata.filesize;
+            } else {
+                mount->filePointers[i].offset = location;
             }
-            readBuffer[c1_offset] = encoded[1];
+        }
+    }
+    pthread_mutex_unlock(&mount->filePointerLock);
 
-            // Maybe modify c0 as well.
-            if (c1_block == c0_block) {
-                readBuffer[c0_offset] = encoded[0];
-            }
+    return 0;
+}
 
-            // Write C1
-            if (blockWrite(c1_block, readBuffer)) {
-                file_errno = EBADDEV;
-                printDevError("device err");
-                free(data);
-                return -1;
-            }
+/**
+ * @brief Gets the open handle with the given number.
+ *
+ * @return struct FileHandle* or NULL (with file_errno set) if it is not open.
+ */
+struct FileHandle *_getHandle(int handle) {
+    pthread_mutex_lock(&mount->handleLock);
+    int open = handle >= 0 && handle < MAX_HANDLES && mount->handles[handle].inUse;
+    pthread_mutex_unlock(&mount->handleLock);
+    if (!open) {
+        file_errno = EOTHER;
+        return NULL;
+    }
+    return &mount->handles[handle];
+}
 
-            // Modify and write c0
-            if (c1_block != c0_block) {
-                if (blockRead(c0_block, readBuffer) == -1) {
-                    file_errno = EBADDEV;
-                    printDevError("device err");
-                    free(data);
-                    return -1;
-                }
-                readBuffer[c0_offset] = encoded[0];
-                if (blockWrite(c0_block, readBuffer)) {
-                    file_errno = EBADDEV;
-                    printDevError("device err");
-                    free(data);
-                    return -1;
-                }
-            }
+/**
+ * @brief Gets the size of an open file, kept up to date by every write.
+ */
+int _handleFilesize(struct FileHandle *fh) {
+    pthread_mutex_lock(&mount->handleLock);
+    int filesize = fh->filesize;
+    pthread_mutex_unlock(&mount->handleLock);
+    return filesize;
+}
 
-            free(data);
-            return 0;
-        }
+/*
+ * Opens a file so it can be read and written without resolving the pathname on every call.
+ * The filename is a full pathname.
+ * The file must have been created before this call is made.
+ * Returns the file handle (>= 0) if no problem or -1 if the call failed.
+ */
+int fsOpen(char *fileName) {
+    struct PathLookup lookup;
+    if (_resolvePath(fileName, 'F', &lookup) != 0) {
+        return -1;
+    }
+    if (lookup.entry.startBlockIdx == -1) {
+        file_errno = ENOSUCHFILE;
+        return -1;
     }
 
-    free(data);
+    // The entry is read again and the handle made with its directory locked, so no
+    // write or move of the entry in between can be missed.
+    struct ChainLock *dir = _lockChain(lookup.parentBlockIdx, 0);
+    if (dir == NULL) {
+        return -1;
+    }
+    int dirLength = _dirLength(dir);
+    if (dirLength < 0) {
+        _unlockChain(dir);
+        return -1;
+    }
+    lookup.entry = _lookupEntry(lookup.parentBlockIdx, dirLength, lookup.name, 'F');
+    if (lookup.entry.startBlockIdx == -1) {
+        // Gone since it was found
+        _unlockChain(dir);
+        file_errno = ENOSUCHFILE;
+        return -1;
+    }
 
-    // Not found
+    pthread_mutex_lock(&mount->handleLock);
+    for (int i = 0; i < MAX_HANDLES; i++) {
+        if (!mount->handles[i].inUse) {
+            mount->handles[i].inUse = 1;
+            mount->handles[i].startBlockIdx = lookup.entry.startBlockIdx;
+            mount->handles[i].parentBlockIdx = lookup.parentBlockIdx;
+            mount->handles[i].entryOffset = lookup.entry.entryOffset;
+            memcpy(mount->handles[i].name, lookup.name, 8);
+            mount->handles[i].filesize = lookup.entry.filesize;
+            mount->handles[i].position = 0;
+            mount->handles[i].cursor.blockIdx = -1;
+            mount->handles[i].cursor.blockStart = 0;
+            pthread_mutex_unlock(&mount->handleLock);
+            _unlockChain(dir);
+            return i;
+        }
+    }
+    pthread_mutex_unlock(&mount->handleLock);
+    _unlockChain(dir);
+
+    // Handle table full
     file_errno = EOTHER;
     return -1;
 }
 
 /*
- * Makes a file with a fully qualified pathname starting with "/".
- * It automatically creates all intervening directories.
- * Pathnames can consist of any printable ASCII characters (0x20 - 0x7e)
- * including the space character.
- * The occurrence of "/" is interpreted as starting a new directory
- * (or the file name).
- * Each section of the pathname must be between 1 and 7 bytes long (not
- * counting the "/"s).
- * The pathname cannot finish with a "/" so the only way to create a directory
- * is to create a file in that directory. This is not true for the root
- * directory "/" as this needs to be created when format is called.
- * The total length of a pathname is limited only by the size of the device.
+ * Closes a handle returned by fsOpen.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int fsClose(int handle) {
+    struct FileHandle *fh = _getHandle(handle);
+    if (fh == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mount->handleLock);
+    fh->inUse = 0;
+    pthread_mutex_unlock(&mount->handleLock);
+    return _flushFAT();
+}
+
+/*
+ * Writes data onto the end of an open file.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int fsWrite(int handle, void *data, int length) {
+    struct FileHandle *fh = _getHandle(handle);
+    if (fh == NULL) {
+        return -1;
+    }
+
+    // The handle's size is current once the file is locked, every write updates it before unlocking
+    struct ChainLock *fileLock = _lockChain(fh->startBlockIdx, 1);
+    if (fileLock == NULL) {
+        return -1;
+    }
+    int filesize = _handleFilesize(fh);
+
+    if (length > _maxFilesize() - filesize) {
+        _unlockChain(fileLock);
+        file_errno = ENOROOM;
+        return -1;
+    }
+    if (_append(fh->startBlockIdx, filesize, data, length) != 0 ||
+        _recordGrowth(fh->startBlockIdx, fh->parentBlockIdx, fh->name, fh, filesize + length, length) != 0) {
+        _unlockChain(fileLock);
+        return -1;
+    }
+    _unlockChain(fileLock);
+
+    return _flushFAT();
+}
+
+/*
+ * Reads data from the handle's position, then moves the position past it.
+ * Reading past the end of the file is an error.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int fsRead(int handle, void *data, int length) {
+    struct FileHandle *fh = _getHandle(handle);
+    if (fh == NULL) {
+        return -1;
+    }
+    if (length < 0 || fh->position + length > _handleFilesize(fh)) {
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    struct ChainLock *fileLock = _lockChain(fh->startBlockIdx, 0);
+    if (fileLock == NULL) {
+        return -1;
+    }
+    int failed = _readAt(fh->startBlockIdx, fh->position, length, data, &fh->cursor);
+    _unlockChain(fileLock);
+    if (failed) {
+        return -1;
+    }
+    fh->position += length;
+
+    return 0;
+}
+
+/*
+ * Repositions the handle at the specified byte offset from the start of the file.
+ * If the location is after the end of the file, it is moved to the end of the file.
  * Returns 0 if no problem or -1 if the call failed.
  */
-int create(char *pathName) {
-    unsigned char nameBuffer[8] = {'\0'};
-    int cwdAddress = getRootIndex();
-    int cwdLength = _getRootSize();
+int fsSeek(int handle, int location) {
+    struct FileHandle *fh = _getHandle(handle);
+    if (fh == NULL) {
+        return -1;
+    }
+    if (location < 0) {
+        file_errno = EOTHER;
+        return -1;
+    }
+
+    fh->position = _min(location, _handleFilesize(fh));
+    return 0;
+}
+
+/**
+ * @brief Re-encodes the fields of every slot of a directory's hashed index.
+ *
+ * @return int 0 for success, -1 for error.
+ */
+int _convertIndex(int startBlockIdx, int length, const struct Layout *from, const struct Layout *to) {
+    unsigned char *table = malloc(length);
+    if (table == NULL || _read(startBlockIdx, length, 0, table) != 0) {
+        file_errno = EOTHER;
+        free(table);
+        return -1;
+    }
+
+    for (int i = 0; i < length; i += from->fieldSize) {
+        _putRawAs(to, table + i, _getRawAs(from, table + i));
+    }
+
+    int result = _writeAt(startBlockIdx, 0, table, length);
+    free(table);
+    return result;
+}
+
+/**
+ * @brief Re-encodes every entry of a directory, remembering its subdirectories.
+ *
+ * @param pending stack of directories still to convert (start block, size pairs), grown as needed
+ * @return int 0 for success, -1 for error.
+ */
+int _convertDirectory(int dirBlock, int dirLength, const struct Layout *from, const struct Layout *to, int **pending,
+                      int *nPending, int *capacity) {
+    if (dirLength == 0) {
+        return 0;
+    }
 
-    unsigned char parentNameBuffer[8];
-    int cwdParentAddress; // Start block number of cwd parent
-    int cwdParentLength;  // Length of dir file for cwd parent
+    unsigned char *data = malloc(dirLength);
+    if (data == NULL || _read(dirBlock, dirLength, 0, data) != 0) {
+        file_errno = EOTHER;
+        free(data);
+        return -1;
+    }
 
-    // Navigate and create requested directories.
-    for (int i = 1; pathName[i] != '\0'; i++) {
-        unsigned char c = pathName[i];
-
-        if (c == '/') {
-            // (Create if necessary and) Navigate to the directory specified.
-            struct DirectoryEntry newDirAddr;
-            // Read cwd file
-            if (cwdLength > 0) {
-                unsigned char *data = malloc(cwdLength);
-                if (_read(cwdAddress, cwdLength, 0, data) != 0) {
+    for (int i = 0; i + from->entrySize <= dirLength; i += from->entrySize) {
+        uint32_t start = _getRawAs(from, data + i + 8);
+        uint32_t size = _getRawAs(from, data + i + 8 + from->fieldSize);
+        if (data[i + 7] == 'D') {
+            if (*nPending + 2 > *capacity) {
+                *capacity = (*capacity == 0) ? 64 : *capacity * 2;
+                int *grown = realloc(*pending, *capacity * sizeof(int));
+                if (grown == NULL) {
+                    file_errno = EOTHER;
                     free(data);
-                    return -9;
+                    return -1;
                 }
-
-                // Get new directory file address
-                newDirAddr = _getAddressFromDirectoryFile(data, cwdLength, nameBuffer, 'D');
-                free(data);
-            } else {
-                newDirAddr.startBlockIdx = -1;
+                *pending = grown;
             }
+            (*pending)[(*nPending)++] = (int)start;
+            (*pending)[(*nPending)++] = (int)size;
+        } else if (data[i + 7] == 'I' && _convertIndex((int)start, (int)size, from, to) != 0) {
+            free(data);
+            return -1;
+        }
 
-            if (newDirAddr.startBlockIdx == -1) {
-                // Create directory
-                int newDirStartIdx;
-                if (_createFile(nameBuffer, 'D', cwdAddress, cwdLength, &newDirStartIdx) != 0) {
-                    return -2;
-                }
-
-                // We must update the cwd parent's dir file to increase the filesize record of cwd
-                // If it is root, we know where filesize is.
-                if (cwdAddress == getRootIndex()) {
-                    _setRootSize(cwdLength + 12);
-                } else {
-                    if (_updateFilesize(cwdParentAddress, cwdParentLength, parentNameBuffer, 'D', cwdLength + 12) != 0) {
-                        return -3;
-                    }
-                }
-
-                // Navigate to new directory
-                cwdParentAddress = cwdAddress;
-                cwdParentLength = cwdLength + 12;
-
-                cwdAddress = newDirStartIdx;
-                cwdLength = 0;
+        _putRawAs(to, data + i + 8, start);
+        _putRawAs(to, data + i + 8 + to->fieldSize, size);
+    }
 
-            } else {
-                // 'Navigate' to directory
-                cwdParentAddress = cwdAddress;
-                cwdParentLength = cwdLength;
+    int result = _writeAt(dirBlock, 0, data, dirLength);
+    free(data);
+    return result;
+}
 
-                cwdAddress = newDirAddr.startBlockIdx;
-                cwdLength = newDirAddr.filesize;
-            }
+/*
+ * Rewrites a device formatted as WFS or WF2 in place, as WFL2 or WFL4.
+ * The entries keep their sizes and the reserved area keeps its length (the FAT moves
+ * by one byte and its old offset is always odd), so only the fields are re-encoded:
+ * every directory first, then the FAT and the header.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int convertLayout(void) {
+    if (isFormatted() != 1) {
+        file_errno = EOTHER;
+        return -1;
+    }
 
-            strncpy((char *)parentNameBuffer, (char *)nameBuffer, 7);
-            nameBuffer[0] = '\0'; // Clear name buffer
-        } else {
-            // Still processing name. Add to buffer and keep going.
-            strncat((char *)nameBuffer, (char *)&c, 1);
-        }
+    // Start from what is on the device
+    mount->root_block_idx = -1;
+    mount->rootSize = -1;
+    free(mount->fatCache.entries);
+    mount->fatCache.entries = NULL;
+    memset(mount->dentryCache, 0, sizeof(mount->dentryCache));
+    _freeChainLocks();
+    if (_loadFAT() != 0 || _getRootSize() < 0) {
+        return -1;
+    }
+    if (mount->layout.littleEndian) {
+        return 0;
     }
 
-    // File creation requested, create file.
-    if (nameBuffer != '\0') {
-        int newBlockIdx; // Throwaway variable
-        if (_createFile(nameBuffer, 'F', cwdAddress, cwdLength, &newBlockIdx) != 0) {
-            return -4;
-        }
-        // We must update the cwd parent's dir file to increase the filesize record of cwd
-        // If it is root, we know where filesize is.
-        if (cwdAddress == getRootIndex()) {
-            _setRootSize(cwdLength + 12);
-        } else {
-            if (_updateFilesize(cwdParentAddress, cwdParentLength, parentNameBuffer, 'D', cwdLength + 12) != 0) {
-                return -5;
-            }
+    struct Layout from = mount->layout;
+    struct Layout to = layouts[(from.fieldSize == 2) ? FS_WFL2 : FS_WFL4];
+    int reserved = _reservedBlocks();
+    mount->layout = to;
+    if (_reservedBlocks() != reserved) {
+        mount->layout = from;
+        file_errno = EOTHER;
+        return -1;
+    }
+    mount->layout = from;
+
+    int *pending = NULL;
+    int nPending = 0;
+    int capacity = 0;
+    int converted = 0;
+    int result = _convertDirectory(getRootIndex(), mount->rootSize, &from, &to, &pending, &nPending, &capacity);
+    while (result == 0 && nPending > 0) {
+        // A directory tree can't hold more directories than there are blocks
+        if (++converted > numBlocks()) {
+            file_errno = EOTHER;
+            result = -1;
+            break;
         }
+        nPending -= 2;
+        result = _convertDirectory(pending[nPending], pending[nPending + 1], &from, &to, &pending, &nPending, &capacity);
+    }
+    free(pending);
+    if (result != 0) {
+        return -1;
+    }
 
-        // Create file pointer
-        filePointers[nOpenFiles].startBlockIdx = newBlockIdx;
-        filePointers[nOpenFiles].offset = 0;
+    // Rewrite the whole FAT, then the identifier and the root size in front of it
+    mount->layout = to;
+    mount->fatCache.dirtyLow = 0;
+    mount->fatCache.dirtyHigh = numBlocks() - 1;
+    if (_flushFAT() != 0) {
+        return -1;
+    }
 
-        nOpenFiles++;
-        return 0;
-    } else {
-        file_errno = EOTHER;
+    unsigned char *header = blockPinMut(1);
+    if (header == NULL) {
+        file_errno = EBADDEV;
+        printDevError("device err");
+        return -1;
+    }
+    memcpy(header, to.id, strlen(to.id));
+    _encode(mount->rootSize, header + to.rootSizeOffset);
+    if (blockUnpin(header)) {
+        file_errno = EBADDEV;
+        printDevError("device err");
         return -1;
     }
+
+    free(mount->subtreeSizes.slots);
+    mount->subtreeSizes.slots = NULL;
+    mount->subtreeSizes.capacity = 0;
+    mount->subtreeSizes.count = 0;
+    memset(mount->dentryCache, 0, sizeof(mount->dentryCache));
+    return 0;
 }
 
 /**
- * Recurse down the directory tree and retrieve the size
+ * @brief The error of a call that has just failed, for the _r entry points.
+ *
+ * @return int file_errno, or EOTHER if the call failed without setting it.
  */
-int _getDirectorySize(int dirAddr, int dirLength) {
-    int sum = dirLength;
+int _failure() {
+    return (file_errno != 0) ? file_errno : EOTHER;
+}
 
-    // Read request dir
-    if (dirLength > 0) {
-        unsigned char *directory = malloc(dirLength);
-        if (_read(dirAddr, dirLength, 0, directory) != 0) {
-            file_errno = EOTHER;
-            free(directory);
-            return -1;
-        }
+int format_r(char *volumeName) {
+    file_errno = 0;
+    return (format(volumeName) == 0) ? 0 : _failure();
+}
 
-        for (int i = 0; i < dirLength; i += 12) {
-            if (directory[i + 7] == 'D') {
-                sum += _getDirectorySize(_getDecoded(directory[i + 8], directory[i + 9]), _getDecoded(directory[i + 10], directory[i + 11]));
-            } else {
-                sum += _getDecoded(directory[i + 10], directory[i + 11]);
-            }
-        }
+int formatLayout_r(char *volumeName, int fsLayout) {
+    file_errno = 0;
+    return (formatLayout(volumeName, fsLayout) == 0) ? 0 : _failure();
+}
 
-        free(directory);
-    }
+int convertLayout_r(void) {
+    file_errno = 0;
+    return (convertLayout() == 0) ? 0 : _failure();
+}
 
-    return sum;
+int volumeName_r(char *result) {
+    file_errno = 0;
+    return (volumeName(result) == 0) ? 0 : _failure();
 }
 
-/*
- * Returns a list of all files in the named directory.
- * The "result" string is filled in with the output.
- * The result looks like this
+int create_r(char *pathName) {
+    file_errno = 0;
+    return (create(pathName) == 0) ? 0 : _failure();
+}
 
-/dir1:
-file1	42
-file2	0
+int list_r(char *result, char *directoryName) {
+    file_errno = 0;
+    return (list(result, directoryName) == 0) ? 0 : _failure();
+}
 
- * The fully qualified pathname of the directory followed by a colon and
- * then each file name followed by a tab "\t" and then its file size.
- * Each file on a separate line.
- * The directoryName is a full pathname.
- */
-void list(char *result, char *directoryName) {
-    result[0] = '\0';
-    unsigned char nameBuffer[8] = {'\0'};
-    int cwdAddress = getRootIndex();
-    int cwdLength = _getRootSize();
-
-    // Navigate requested directory.
-    for (int i = 1; ((i < strlen(directoryName)) || (directoryName[i] != '\0')); i++) {
-        unsigned char c = directoryName[i];
-
-        if (c == '/') {
-            // Get directory file address
-            struct DirectoryEntry dirAddr = getAddressFromDirectory(cwdAddress, cwdLength, nameBuffer, 'D');
-            if (dirAddr.startBlockIdx == -1) {
-                file_errno = ENOSUCHFILE;
-                return;
-            } else {
-                // 'Navigate' to directory
-                cwdAddress = dirAddr.startBlockIdx;
-                cwdLength = dirAddr.filesize;
-            }
+int a2write_r(char *fileName, void *data, int length) {
+    file_errno = 0;
+    return (a2write(fileName, data, length) == 0) ? 0 : _failure();
+}
 
-            nameBuffer[0] = '\0'; // Clear name buffer
-        } else {
-            // Still processing name. Add to buffer and keep going.
-            strncat((char *)nameBuffer, (char *)&c, 1);
-        }
-    }
+int a2read_r(char *fileName, void *data, int length) {
+    file_errno = 0;
+    return (a2read(fileName, data, length) == 0) ? 0 : _failure();
+}
 
-    // Navigate to request directory
-    if (nameBuffer[0] != '\0') {
-        struct DirectoryEntry dirAddr = getAddressFromDirectory(cwdAddress, cwdLength, nameBuffer, 'D');
-        if (dirAddr.startBlockIdx == -1) {
-            file_errno = ENOSUCHFILE;
-            return;
-        } else {
-            // 'Navigate' to directory
-            cwdAddress = dirAddr.startBlockIdx;
-            cwdLength = dirAddr.filesize;
-        }
-    }
+int seek_r(char *fileName, int location) {
+    file_errno = 0;
+    return (seek(fileName, location) == 0) ? 0 : _failure();
+}
 
-    // Print dir contents
-    strncat(result, directoryName, strlen(directoryName) + 1);
-    strcat(result, ":\n");
+int fsOpen_r(char *fileName, int *handle) {
+    file_errno = 0;
+    *handle = fsOpen(fileName);
+    return (*handle >= 0) ? 0 : _failure();
+}
 
-    // Read request dir
-    if (cwdLength > 0) {
-        unsigned char *data = malloc(cwdLength);
-        if (_read(cwdAddress, cwdLength, 0, data) != 0) {
-            free(data);
-            return;
-        }
+int fsClose_r(int handle) {
+    file_errno = 0;
+    return (fsClose(handle) == 0) ? 0 : _failure();
+}
 
-        for (int i = 0; i < cwdLength; i += 12) {
-            strncat(result, (char *)data + i, 7); // directory/file name
-            strcat(result, ":\t");
-            int filesize = _getDecoded(data[i + 10], data[i + 11]);
-            char filesizeFormatted[6]; // max filesize is 256^2 -> I.e. 5 chars max.
-            if (data[i + 7] == 'D') {
-                sprintf(filesizeFormatted, "%i", _getDirectorySize(_getDecoded(data[i + 8], data[i + 9]), filesize));
-            } else {
-                sprintf(filesizeFormatted, "%i", filesize);
-            }
-            strncat(result, filesizeFormatted, 5); // size
-            strcat(result, "\n");                  // each file on newline
-        }
-    }
+int fsWrite_r(int handle, void *data, int length) {
+    file_errno = 0;
+    return (fsWrite(handle, data, length) == 0) ? 0 : _failure();
+}
 
-    strncat(result, "\0", 1);
+int fsRead_r(int handle, void *data, int length) {
+    file_errno = 0;
+    return (fsRead(handle, data, length) == 0) ? 0 : _failure();
 }
 
-/*
- * Writes data onto the end of the file.
- * Copies "length" bytes from data and appends them to the file.
- * The filename is a full pathname.
- * The file must have been created before this call is made.
- * Returns 0 if no problem or -1 if the call failed.
- */
-int a2write(char *fileName, void *data, int length) {
-    unsigned char nameBuffer[8] = {'\0'};
-    int cwdAddress = getRootIndex();
-    int cwdLength = _getRootSize();
-
-    // Navigate to file
-    for (int i = 1; fileName[i] != '\0'; i++) {
-        unsigned char c = fileName[i];
-        if (c == '/') {
-            // Get directory file address
-            struct DirectoryEntry dirAddr = getAddressFromDirectory(cwdAddress, cwdLength, nameBuffer, 'D');
-            if (dirAddr.startBlockIdx == -1) {
-                file_errno = ENOSUCHFILE;
-                return -5;
-            } else {
-                // 'Navigate' to directory
-                cwdAddress = dirAddr.startBlockIdx;
-                cwdLength = dirAddr.filesize;
-            }
+int fsSeek_r(int handle, int location) {
+    file_errno = 0;
+    return (fsSeek(handle, location) == 0) ? 0 : _failure();
+}
 
-            nameBuffer[0] = '\0'; // Clear name buffer
-        } else {
-            // Still processing name. Add to buffer and keep going.
-            strncat((char *)nameBuffer, (char *)&c, 1);
-        }
-    }
+int fsOpenDir_r(char *directoryName, int *handle) {
+    file_errno = 0;
+    *handle = fsOpenDir(directoryName);
+    return (*handle >= 0) ? 0 : _failure();
+}
 
-    struct DirectoryEntry file = getAddressFromDirectory(cwdAddress, cwdLength, nameBuffer, 'F');
-    if (file.startBlockIdx == -1) {
-        file_errno = ENOSUCHFILE;
-        return -3;
+int fsReadDir_r(int handle, struct DirEntry *entry, int *found) {
+    file_errno = 0;
+    *found = fsReadDir(handle, entry);
+    if (*found < 0) {
+        *found = 0;
+        return _failure();
     }
+    return 0;
+}
 
-    // File exists, append data
-    if (_append(file.startBlockIdx, file.filesize, data, length) != 0) {
-        return -2;
-    }
+int fsCloseDir_r(int handle) {
+    file_errno = 0;
+    return (fsCloseDir(handle) == 0) ? 0 : _failure();
+}
 
-    // Update file size for file
-    _updateFilesize(cwdAddress, cwdLength, nameBuffer, 'F', file.filesize + length);
+/**
+ * @brief Makes m the calling thread's current mount, and its device the current device.
+ *
+ * @return struct wfs_mount* the previous current mount, to go back to with _leave.
+ */
+struct wfs_mount *_enter(struct wfs_mount *m) {
+    struct wfs_mount *previous = mount;
+    mount = m;
+    useDevice(m->device);
+    return previous;
+}
 
-    return 0;
+void _leave(struct wfs_mount *previous) {
+    mount = previous;
+    useDevice(previous->device);
 }
 
 /*
- * Reads data from the start of the file.
- * Maintains a file position so that subsequent reads continue
- * from where the last read finished.
- * The filename is a full pathname.
- * The file must have been created before this call is made.
- * Returns 0 if no problem or -1 if the call failed.
+ * Mounts the device file at path, accessed as options gives, or with DEVICE_MMAP if options is NULL.
+ * Nothing is read from the device until it is used, as with the default mount.
+ * Returns the mount, or NULL if the call failed.
  */
-int a2read(char *fileName, void *data, int length) {
-    if (nOpenFiles == 0) {
-        regenerateFilePointers();
+struct wfs_mount *fsMount(const char *path, const struct DeviceOptions *options) {
+    struct DeviceOptions deviceOptions = {DEVICE_MMAP, NULL, 0, 0, DEVICE_SPARSE, 0};
+    if (options != NULL) {
+        deviceOptions = *options;
     }
-
-    if (length == 0) {
-        return 0;
+    if (path != NULL) {
+        deviceOptions.path = path;
     }
 
-    unsigned char nameBuffer[8] = {'\0'};
-    int cwdAddress = getRootIndex();
-    int cwdLength = _getRootSize();
-
-    // Navigate to file
-    for (int i = 1; fileName[i] != '\0'; i++) {
-        unsigned char c = fileName[i];
-
-        if (c == '/') {
-            // Get directory file address
-            struct DirectoryEntry dirAddr = getAddressFromDirectory(cwdAddress, cwdLength, nameBuffer, 'D');
-            if (dirAddr.startBlockIdx == -1) {
-                file_errno = ENOSUCHFILE;
-                return -3;
-            } else {
-                // 'Navigate' to directory
-                cwdAddress = dirAddr.startBlockIdx;
-                cwdLength = dirAddr.filesize;
-            }
+    struct wfs_mount *m = calloc(1, sizeof(struct wfs_mount));
+    if (m == NULL) {
+        file_errno = EOTHER;
+        return NULL;
+    }
+    m->device = openDevice(&deviceOptions);
+    if (m->device == NULL) {
+        file_errno = EBADDEV;
+        printDevError("device err");
+        free(m);
+        return NULL;
+    }
 
-            nameBuffer[0] = '\0'; // Clear name buffer
-        } else {
-            // Still processing name. Add to buffer and keep going.
-            strncat((char *)nameBuffer, (char *)&c, 1);
-        }
+    m->root_block_idx = -1;
+    m->layout = layouts[FS_WFL2];
+    m->rootSize = -1;
+    m->fatCache.dirtyLow = -1;
+    m->fatCache.dirtyHigh = -1;
+    pthread_key_create(&m->blockCacheKey, _returnBlockCache);
+    pthread_mutex_t *locks[] = {&m->rootIndexLock, &m->fatLock,       &m->tailLock,   &m->dentryLock,
+                                &m->subtreeLock,   &m->filePointerLock, &m->handleLock, &m->chainLocksLock};
+    for (int i = 0; i < (int)(sizeof(locks) / sizeof(locks[0])); i++) {
+        pthread_mutex_init(locks[i], NULL);
     }
+    return m;
+}
 
-    struct DirectoryEntry fileMetadata = getAddressFromDirectory(cwdAddress, cwdLength, nameBuffer, 'F');
-    if (fileMetadata.startBlockIdx == -1) {
-        file_errno = ENOSUCHFILE;
+/*
+ * Writes back the mount's FAT, then frees everything it holds and closes its device.
+ * Returns 0 if no problem or -1 if the FAT could not be written.
+ */
+int fsUnmount(struct wfs_mount *m) {
+    if (m == NULL || m == &defaultMount) {
+        file_errno = EOTHER;
         return -1;
     }
 
-    int offset = 0;
-    int fpIdx = -1;
-    // Check for any file pointers
-    for (int i = 0; i < nOpenFiles; i++) {
-        if (filePointers[i].startBlockIdx == fileMetadata.startBlockIdx) {
+    struct wfs_mount *previous = _enter(m);
+    int result = _flushFAT();
 
-            offset = filePointers[i].offset;
-            fpIdx = i;
-        }
+    // Blocks in the threads' caches were never linked, there is nothing to give back
+    pthread_key_delete(m->blockCacheKey);
+    while (m->blockCaches != NULL) {
+        struct BlockCache *cache = m->blockCaches;
+        m->blockCaches = cache->link;
+        free(cache);
     }
-
-    if (_read(fileMetadata.startBlockIdx, length, offset, data) != 0) {
-        return -5;
+    _freeChainLocks();
+    free(m->fatCache.entries);
+    free(m->freeMap.words);
+    free(m->filePointers);
+    free(m->subtreeSizes.slots);
+    _leave(previous);
+
+    closeDevice(m->device);
+    pthread_mutex_t *locks[] = {&m->rootIndexLock, &m->fatLock,       &m->tailLock,   &m->dentryLock,
+                                &m->subtreeLock,   &m->filePointerLock, &m->handleLock, &m->chainLocksLock};
+    for (int i = 0; i < (int)(sizeof(locks) / sizeof(locks[0])); i++) {
+        pthread_mutex_destroy(locks[i]);
     }
+    free(m);
+    return result;
+}
 
-    // Update file pointer
-    if (fpIdx < 0) {
-        file_errno = EOTHER;
-        return -2;
-    } else {
-        filePointers[fpIdx].startBlockIdx = fileMetadata.startBlockIdx;
-        filePointers[fpIdx].offset = length;
-    }
+int format_m(struct wfs_mount *m, char *volumeName) {
+    struct wfs_mount *previous = _enter(m);
+    int result = format(volumeName);
+    _leave(previous);
+    return result;
+}
 
-    return 0;
+int formatLayout_m(struct wfs_mount *m, char *volumeName, int fsLayout) {
+    struct wfs_mount *previous = _enter(m);
+    int result = formatLayout(volumeName, fsLayout);
+    _leave(previous);
+    return result;
 }
 
-/*
- * Repositions the file pointer for the file at the specified location.
- * All positive integers are byte offsets from the start of the file.
- * 0 is the beginning of the file.
- * If the location is after the end of the file, move the location
- * pointer to the end of the file.
- * The filename is a full pathname.
- * The file must have been created before this call is made.
- * Returns 0 if no problem or -1 if the call failed.
- */
-int seek(char *fileName, int location) {
-    if (nOpenFiles == 0) {
-        regenerateFilePointers();
-    }
-    unsigned char nameBuffer[8] = {'\0'};
-    int cwdAddress = getRootIndex();
-    int cwdLength = _getRootSize();
+int convertLayout_m(struct wfs_mount *m) {
+    struct wfs_mount *previous = _enter(m);
+    int result = convertLayout();
+    _leave(previous);
+    return result;
+}
 
-    // Navigate to file
-    for (int i = 1; fileName[i] != '\0'; i++) {
-        unsigned char c = fileName[i];
+int volumeName_m(struct wfs_mount *m, char *result) {
+    struct wfs_mount *previous = _enter(m);
+    int status = volumeName(result);
+    _leave(previous);
+    return status;
+}
 
-        if (c == '/') {
-            // Get directory file address
-            struct DirectoryEntry dirAddr = getAddressFromDirectory(cwdAddress, cwdLength, nameBuffer, 'D');
-            if (dirAddr.startBlockIdx == -1) {
-                file_errno = ENOSUCHFILE;
-                return -1;
-            } else {
-                // 'Navigate' to directory
-                cwdAddress = dirAddr.startBlockIdx;
-                cwdLength = dirAddr.filesize;
-            }
+int create_m(struct wfs_mount *m, char *pathName) {
+    struct wfs_mount *previous = _enter(m);
+    int result = create(pathName);
+    _leave(previous);
+    return result;
+}
 
-            nameBuffer[0] = '\0'; // Clear name buffer
-        } else {
-            // Still processing name. Add to buffer and keep going.
-            strncat((char *)nameBuffer, (char *)&c, 1);
-        }
-    }
+int list_m(struct wfs_mount *m, char *result, char *directoryName) {
+    struct wfs_mount *previous = _enter(m);
+    int status = list(result, directoryName);
+    _leave(previous);
+    return status;
+}
 
-    struct DirectoryEntry fileMetadata = getAddressFromDirectory(cwdAddress, cwdLength, nameBuffer, 'D');
+int a2write_m(struct wfs_mount *m, char *fileName, void *data, int length) {
+    struct wfs_mount *previous = _enter(m);
+    int result = a2write(fileName, data, length);
+    _leave(previous);
+    return result;
+}
 
-    // Edit file pointer
-    for (int i = 0; i < nOpenFiles; i++) {
-        // struct FilePointer fp = ;
-        if (filePointers[i].startBlockIdx == fileMetadata.startBlockIdx) {
-            // Set location to EoF if too large
-            if (location > fileMetadata.filesize) {
-                filePointers[i].offset = fileMetadata.filesize;
-            } else {
-                filePointers[i].offset = location;
-            }
-        }
-    }
+int a2read_m(struct wfs_mount *m, char *fileName, void *data, int length) {
+    struct wfs_mount *previous = _enter(m);
+    int result = a2read(fileName, data, length);
+    _leave(previous);
+    return result;
+}
 
-    return 0;
+int seek_m(struct wfs_mount *m, char *fileName, int location) {
+    struct wfs_mount *previous = _enter(m);
+    int result = seek(fileName, location);
+    _leave(previous);
+    return result;
+}
+
+int fsOpen_m(struct wfs_mount *m, char *fileName) {
+    struct wfs_mount *previous = _enter(m);
+    int result = fsOpen(fileName);
+    _leave(previous);
+    return result;
+}
+
+int fsClose_m(struct wfs_mount *m, int handle) {
+    struct wfs_mount *previous = _enter(m);
+    int result = fsClose(handle);
+    _leave(previous);
+    return result;
+}
+
+int fsWrite_m(struct wfs_mount *m, int handle, void *data, int length) {
+    struct wfs_mount *previous = _enter(m);
+    int result = fsWrite(handle, data, length);
+    _leave(previous);
+    return result;
+}
+
+int fsRead_m(struct wfs_mount *m, int handle, void *data, int length) {
+    struct wfs_mount *previous = _enter(m);
+    int result = fsRead(handle, data, length);
+    _leave(previous);
+    return result;
+}
+
+int fsSeek_m(struct wfs_mount *m, int handle, int location) {
+    struct wfs_mount *previous = _enter(m);
+    int result = fsSeek(handle, location);
+    _leave(previous);
+    return result;
+}
+
+int fsOpenDir_m(struct wfs_mount *m, char *directoryName) {
+    struct wfs_mount *previous = _enter(m);
+    int result = fsOpenDir(directoryName);
+    _leave(previous);
+    return result;
+}
+
+int fsReadDir_m(struct wfs_mount *m, int handle, struct DirEntry *entry) {
+    struct wfs_mount *previous = _enter(m);
+    int result = fsReadDir(handle, entry);
+    _leave(previous);
+    return result;
+}
+
+int fsCloseDir_m(struct wfs_mount *m, int handle) {
+    struct wfs_mount *previous = _enter(m);
+    int result = fsCloseDir(handle);
+    _leave(previous);
+    return result;
 }
@@ -16,8 +16,16 @@
  * When any of the functions cause an error to occur
  * this should be filled in with a suitable value from
  * the #defines above.
+ * Each thread has its own, holding the error of its own last failed call.
+ */
+extern _Thread_local int file_errno;
+
+/*
+ * The calls below may be made from several threads at once, except
+ * format, formatLayout and convertLayout, which must run on their own.
+ * Appends to one file are applied one at a time; a handle should be
+ * used by one thread at a time.
  */
-extern int file_errno;
 
 /*
  * Formats the device for use by this file system.
@@ -28,6 +36,33 @@ extern int file_errno;
  */
 int format(char *volumeName);
 
+/*
+ * On-disk layouts, named by the identifier in block 1.
+ * WFS has 16 bit FAT entries and sizes: at most 65534 blocks and 65535 byte files.
+ * WF2 has 32 bit ones, for larger devices and files.
+ * WFL2 and WFL4 are the same as little endian, naturally aligned fields.
+ */
+#define FS_WFS 0
+#define FS_WF2 1
+#define FS_WFL2 2
+#define FS_WFL4 3
+
+/*
+ * Formats the device like format, with the given layout.
+ * format picks WFL2 unless the device has too many blocks for it, or room for larger files.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int formatLayout(char *volumeName, int fsLayout);
+
+/*
+ * Rewrites a device formatted as WFS or WF2 in place, as WFL2 or WFL4.
+ * Devices already in a native layout are left as they are.
+ * Meant to be run on its own (see convert.c): an interrupted conversion
+ * leaves the device unusable.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int convertLayout(void);
+
 /*
  * Places the volume's name in the result.
  * Returns 0 if no problem or -1 if the call failed.
@@ -64,8 +99,9 @@ file2	0
  * then each file name followed by a tab "\t" and then its file size.
  * Each file on a separate line.
  * The directoryName is a full pathname.
+ * Returns 0 if no problem or -1 if the call failed, leaving the entries listed so far.
  */
-void list(char *result, char *directoryName);
+int list(char *result, char *directoryName);
 
 /*
  * Writes data onto the end of the file.
@@ -97,3 +133,146 @@ int a2read(char *fileName, void *data, int length);
  * Returns 0 if no problem or -1 if the call failed.
  */
 int seek(char *fileName, int location);
+
+/*
+ * Opens a file so it can be read and written without resolving the
+ * pathname on every call.
+ * The filename is a full pathname.
+ * The file must have been created before this call is made.
+ * Returns the file handle (>= 0) if no problem or -1 if the call failed.
+ */
+int fsOpen(char *fileName);
+
+/*
+ * Closes a handle returned by fsOpen.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int fsClose(int handle);
+
+/*
+ * Writes data onto the end of an open file.
+ * Copies "length" bytes from data and appends them to the file.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int fsWrite(int handle, void *data, int length);
+
+/*
+ * Reads data from the handle's position and moves the position past it.
+ * Each handle starts at the beginning of the file.
+ * Reading past the end of the file is an error.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int fsRead(int handle, void *data, int length);
+
+/*
+ * Repositions the handle at the specified byte offset from the start of
+ * the file. If the location is after the end of the file, move the
+ * position to the end of the file.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int fsSeek(int handle, int location);
+
+/*
+ * A directory entry as returned by fsReadDir.
+ */
+struct DirEntry {
+    char name[8]; // NUL terminated
+    char type;    // 'F' for a file, 'D' for a directory
+    int startBlock;
+    int size; // for a directory, the total size of everything below it
+};
+
+/*
+ * Opens a directory so its entries can be read one at a time.
+ * The directoryName is a full pathname, "/" for the root.
+ * Returns the directory handle (>= 0) if no problem or -1 if the call failed.
+ */
+int fsOpenDir(char *directoryName);
+
+/*
+ * Reads the next entry of an open directory into entry.
+ * Entries created while the directory is open may or may not be returned.
+ * Returns 1 if an entry was read, 0 at the end of the directory
+ * or -1 if the call failed.
+ */
+int fsReadDir(int handle, struct DirEntry *entry);
+
+/*
+ * Closes a handle returned by fsOpenDir.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int fsCloseDir(int handle);
+
+/*
+ * Reentrant versions of the calls above. Each returns 0 if no problem,
+ * or the error number (one of the #defines above) if the call failed,
+ * so the error can't be confused with another thread's.
+ * file_errno is set as well.
+ * Results the plain calls return are passed back through handle and
+ * found instead: found is 1 if an entry was read, 0 at the end of the
+ * directory.
+ */
+int format_r(char *volumeName);
+int formatLayout_r(char *volumeName, int fsLayout);
+int convertLayout_r(void);
+int volumeName_r(char *result);
+int create_r(char *pathName);
+int list_r(char *result, char *directoryName);
+int a2write_r(char *fileName, void *data, int length);
+int a2read_r(char *fileName, void *data, int length);
+int seek_r(char *fileName, int location);
+int fsOpen_r(char *fileName, int *handle);
+int fsClose_r(int handle);
+int fsWrite_r(int handle, void *data, int length);
+int fsRead_r(int handle, void *data, int length);
+int fsSeek_r(int handle, int location);
+int fsOpenDir_r(char *directoryName, int *handle);
+int fsReadDir_r(int handle, struct DirEntry *entry, int *found);
+int fsCloseDir_r(int handle);
+
+/*
+ * A mounted volume, so several device files can be used at once.
+ * Each mount has its own caches, handles and locks, and can be driven by its own
+ * threads without meeting the others. The calls above use the default mount, on the
+ * device set up with configureDevice (see device.h).
+ */
+struct wfs_mount;
+struct DeviceOptions;
+
+/*
+ * Mounts the device file at path, accessed as options gives (see configureDevice),
+ * or with DEVICE_MMAP and the device's own geometry if options is NULL.
+ * A non NULL path replaces the options' one.
+ * Returns the mount, or NULL if the call failed.
+ */
+struct wfs_mount *fsMount(const char *path, const struct DeviceOptions *options);
+
+/*
+ * Writes back what the mount has cached, then closes its device and frees it.
+ * The mount must no longer be in use. Its open handles go with it.
+ * The default mount can't be unmounted.
+ * Returns 0 if no problem or -1 if the call failed.
+ */
+int fsUnmount(struct wfs_mount *mount);
+
+/*
+ * The calls above, on the given mount rather than the default one.
+ * Handles from fsOpen_m and fsOpenDir_m belong to their mount.
+ */
+int format_m(struct wfs_mount *mount, char *volumeName);
+int formatLayout_m(struct wfs_mount *mount, char *volumeName, int fsLayout);
+int convertLayout_m(struct wfs_mount *mount);
+int volumeName_m(struct wfs_mount *mount, char *result);
+int create_m(struct wfs_mount *mount, char *pathName);
+int list_m(struct wfs_mount *mount, char *result, char *directoryName);
+int a2write_m(struct wfs_mount *mount, char *fileName, void *data, int length);
+int a2read_m(struct wfs_mount *mount, char *fileName, void *data, int length);
+int seek_m(struct wfs_mount *mount, char *fileName, int location);
+int fsOpen_m(struct wfs_mount *mount, char *fileName);
+int fsClose_m(struct wfs_mount *mount, int handle);
+int fsWrite_m(struct wfs_mount *mount, int handle, void *data, int length);
+int fsRead_m(struct wfs_mount *mount, int handle, void *data, int length);
+int fsSeek_m(struct wfs_mount *mount, int handle, int location);
+int fsOpenDir_m(struct wfs_mount *mount, char *directoryName);
+int fsReadDir_m(struct wfs_mount *mount, int handle, struct DirEntry *entry);
+int fsCloseDir_m(struct wfs_mount *mount, int handle);
@@ -20,6 +20,27 @@ extern void TestReadFile(CuTest *);
 extern void TestReadLotsOfFiles(CuTest *);
 extern void TestWriteAndReadWithDirectories(CuTest *);
 extern void TestSeek(CuTest *);
+extern void TestWriteAtBlockBoundary(CuTest *);
+extern void TestHandleWriteAndRead(CuTest *);
+extern void TestSequentialReads(CuTest *);
+extern void TestCreateExistingFile(CuTest *);
+extern void TestLargeDirectory(CuTest *);
+extern void TestDirectorySizesAfterList(CuTest *);
+extern void TestReadDirectory(CuTest *);
+extern void TestAsyncBlockIO(CuTest *);
+extern void TestWideLayout(CuTest *);
+extern void TestConvertLayout(CuTest *);
+extern void TestZeroBlocks(CuTest *);
+extern void TestDiscardBlocks(CuTest *);
+extern void TestParallelWrites(CuTest *);
+extern void TestThreadErrors(CuTest *);
+extern void TestParallelAllocation(CuTest *);
+extern void TestAllocationGroups(CuTest *);
+extern void TestMounts(CuTest *);
+extern void TestBackends(CuTest *);
+extern void TestPins(CuTest *);
+
+extern int configureTestDevice(int argc, char *argv[]);
 
 void RunAllTests(void) {
     CuString *output = CuStringNew();
@@ -39,6 +60,25 @@ void RunAllTests(void) {
     SUITE_ADD_TEST(suite, TestReadLotsOfFiles);
     SUITE_ADD_TEST(suite, TestWriteAndReadWithDirectories);
     SUITE_ADD_TEST(suite, TestSeek);
+    SUITE_ADD_TEST(suite, TestWriteAtBlockBoundary);
+    SUITE_ADD_TEST(suite, TestHandleWriteAndRead);
+    SUITE_ADD_TEST(suite, TestSequentialReads);
+    SUITE_ADD_TEST(suite, TestCreateExistingFile);
+    SUITE_ADD_TEST(suite, TestLargeDirectory);
+    SUITE_ADD_TEST(suite, TestDirectorySizesAfterList);
+    SUITE_ADD_TEST(suite, TestReadDirectory);
+    SUITE_ADD_TEST(suite, TestAsyncBlockIO);
+    SUITE_ADD_TEST(suite, TestWideLayout);
+    SUITE_ADD_TEST(suite, TestConvertLayout);
+    SUITE_ADD_TEST(suite, TestZeroBlocks);
+    SUITE_ADD_TEST(suite, TestDiscardBlocks);
+    SUITE_ADD_TEST(suite, TestParallelWrites);
+    SUITE_ADD_TEST(suite, TestThreadErrors);
+    SUITE_ADD_TEST(suite, TestParallelAllocation);
+    SUITE_ADD_TEST(suite, TestAllocationGroups);
+    SUITE_ADD_TEST(suite, TestMounts);
+    SUITE_ADD_TEST(suite, TestBackends);
+    SUITE_ADD_TEST(suite, TestPins);
 
     CuSuiteRun(suite);
     CuSuiteSummary(suite, output);
@@ -48,6 +88,9 @@ void RunAllTests(void) {
     CuSuiteDelete(suite);
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
+    if (configureTestDevice(argc, argv)) {
+        return 1;
+    }
     RunAllTests();
 }
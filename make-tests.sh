@@ -23,6 +23,10 @@ cat $FILES | grep '^void Test' |
         -e 's/$/(CuTest*);/' \
         -e 's/^/extern /'
 
+echo \
+'
+extern int configureTestDevice(int argc, char *argv[]);'
+
 echo \
 '
 
@@ -48,8 +52,10 @@ echo \
     CuSuiteDelete(suite);
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
+    if (configureTestDevice(argc, argv))
+        return 1;
     RunAllTests();
 }
 '
@@ -5,13 +5,58 @@
  *      Author: Robert Sheehan
  */
 
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "CuTest.h"
+#include "device.h"
 #include "fileSystem.h"
 
+const char *backendNames[] = {"mmap", "pread", "direct", "ram", "uring"};
+
+/*
+ * Sets up the device the tests run on, called by main before RunAllTests.
+ * The tests run on a RAM disk unless a device backend is named:
+ * mmap, pread, direct or uring (each on "device_file").
+ * A block size and number of blocks can follow the backend, otherwise the device gets
+ * the default geometry, whatever an existing device file records.
+ * Freed blocks are discarded, so that path is tested too.
+ * Returns 0 if successful, 1 after printing the usage if not.
+ */
+int configureTestDevice(int argc, char *argv[]) {
+    struct DeviceOptions options = {DEVICE_RAM, NULL, DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS, DEVICE_SPARSE, 1};
+    if (argc > 3) {
+        options.blockSize = atoi(argv[2]);
+        options.numBlocks = atoi(argv[3]);
+    }
+    if (argc > 1) {
+        options.backend = -1;
+        for (int i = 0; i < 5; i++) {
+            if (strcmp(argv[1], backendNames[i]) == 0) {
+                options.backend = i;
+            }
+        }
+    }
+    if (configureDevice(&options)) {
+        fprintf(stderr, "usage: %s [mmap|pread|direct|ram|uring [blockSize numBlocks]]\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Bytes per directory entry in the layout of the formatted device, format picks a wide
+ * layout for the larger geometries.
+ */
+int entrySize() {
+    unsigned char header[blockSize()];
+    blockRead(1, header);
+    return (memcmp(header, "WF2", 3) == 0 || memcmp(header, "WFL4", 4) == 0) ? 16 : 12;
+}
+
 void TestFormat(CuTest *tc) {
     char volName[64];
 
@@ -219,3 +264,948 @@ void TestSeek(CuTest *tc) {
     readResult[5] = '\0';
     CuAssertStrEquals(tc, expectedResult, readResult);
 }
+
+void TestWriteAtBlockBoundary(CuTest *tc) {
+    format("test write at block boundary");
+    create("/fileA");
+    char *data = "1--------10--------20--------30--------40--------50--------60--";
+    CuAssertIntEquals(tc, 0, a2write("/fileA", data, 64));
+    CuAssertIntEquals(tc, 0, a2write("/fileA", "tail", 5));
+    char readResult[128];
+    CuAssertIntEquals(tc, 0, a2read("/fileA", readResult, 69));
+    CuAssertTrue(tc, memcmp(readResult, data, 64) == 0);
+    CuAssertStrEquals(tc, "tail", readResult + 64);
+}
+
+void TestHandleWriteAndRead(CuTest *tc) {
+    format("test handles");
+    create("/dir1/fileA");
+    int fh = fsOpen("/dir1/fileA");
+    CuAssertTrue(tc, fh >= 0);
+    CuAssertIntEquals(tc, 0, fsWrite(fh, "aaaaabbbbb", 10));
+    CuAssertIntEquals(tc, 0, fsWrite(fh, "where", 6));
+    char listResult[1024];
+    list(listResult, "/dir1");
+    CuAssertStrEquals(tc, "/dir1:\nfileA:\t16\n", listResult);
+    char readResult[128];
+    CuAssertIntEquals(tc, 0, fsRead(fh, readResult, 5));
+    readResult[5] = '\0';
+    CuAssertStrEquals(tc, "aaaaa", readResult);
+    CuAssertIntEquals(tc, 0, fsSeek(fh, 10));
+    CuAssertIntEquals(tc, 0, fsRead(fh, readResult, 6));
+    CuAssertStrEquals(tc, "where", readResult);
+    CuAssertIntEquals(tc, -1, fsRead(fh, readResult, 1));
+    CuAssertIntEquals(tc, 0, fsClose(fh));
+    CuAssertIntEquals(tc, -1, fsOpen("/dir1/fileB"));
+}
+
+void TestSequentialReads(CuTest *tc) {
+    format("test sequential reads");
+    create("/fileA");
+    char data[200];
+    for (int i = 0; i < 200; i++) {
+        data[i] = 'a' + i % 26;
+    }
+    a2write("/fileA", data, 200);
+    char readResult[64];
+    for (int pos = 0; pos < 200; pos += 40) {
+        CuAssertIntEquals(tc, 0, a2read("/fileA", readResult, 40));
+        CuAssertTrue(tc, memcmp(readResult, data + pos, 40) == 0);
+    }
+    CuAssertIntEquals(tc, 0, seek("/fileA", 130));
+    CuAssertIntEquals(tc, 0, a2read("/fileA", readResult, 10));
+    CuAssertTrue(tc, memcmp(readResult, data + 130, 10) == 0);
+}
+
+void TestCreateExistingFile(CuTest *tc) {
+    format("test create existing file");
+    CuAssertIntEquals(tc, 0, create("/fileA"));
+    CuAssertIntEquals(tc, -1, create("/fileA"));
+    CuAssertIntEquals(tc, 0, create("/fileA/fileB"));
+    a2write("/fileA", "file", 5);
+    char listResult[1024];
+    char expectedResult[64];
+    sprintf(expectedResult, "/:\nfileA:\t5\nfileA:\t%d\n", entrySize());
+    list(listResult, "/");
+    CuAssertStrEquals(tc, expectedResult, listResult);
+    char readResult[8];
+    CuAssertIntEquals(tc, 0, a2read("/fileA", readResult, 5));
+    CuAssertStrEquals(tc, "file", readResult);
+}
+
+void TestLargeDirectory(CuTest *tc) {
+    format("test large directory");
+    CuAssertIntEquals(tc, 0, create("/big/f0"));
+    int fh = fsOpen("/big/f0");
+    CuAssertIntEquals(tc, 0, fsWrite(fh, "zero", 5));
+    char path[16];
+    for (int i = 1; i < 100; i++) {
+        sprintf(path, "/big/f%d", i);
+        CuAssertIntEquals(tc, 0, create(path));
+    }
+    CuAssertIntEquals(tc, -1, create("/big/f42"));
+    CuAssertIntEquals(tc, 0, fsWrite(fh, "more", 5));
+    CuAssertIntEquals(tc, 0, fsClose(fh));
+    CuAssertIntEquals(tc, 0, a2write("/big/f99", "last", 5));
+
+    char listResult[4096];
+    list(listResult, "/big");
+    int lines = 0;
+    for (char *c = listResult; *c != '\0'; c++) {
+        lines += (*c == '\n');
+    }
+    CuAssertIntEquals(tc, 101, lines);
+    CuAssertTrue(tc, strstr(listResult, "\nf0:\t10\n") != NULL);
+    CuAssertTrue(tc, strstr(listResult, "\nf99:\t5\n") != NULL);
+
+    char readResult[16];
+    CuAssertIntEquals(tc, 0, a2read("/big/f0", readResult, 10));
+    CuAssertStrEquals(tc, "more", readResult + 5);
+}
+
+void TestDirectorySizesAfterList(CuTest *tc) {
+    format("test directory sizes");
+    CuAssertIntEquals(tc, 0, create("/a/b/file"));
+    int entry = entrySize();
+    char listResult[256];
+    char expectedResult[64];
+    sprintf(expectedResult, "/:\na:\t%d\n", 2 * entry);
+    list(listResult, "/");
+    CuAssertStrEquals(tc, expectedResult, listResult);
+
+    // Sizes must stay current once they have been computed
+    CuAssertIntEquals(tc, 0, a2write("/a/b/file", "hello", 6));
+    CuAssertIntEquals(tc, 0, create("/a/c/d/other"));
+    int fh = fsOpen("/a/c/d/other");
+    CuAssertIntEquals(tc, 0, fsWrite(fh, "1234", 4));
+    CuAssertIntEquals(tc, 0, fsClose(fh));
+    sprintf(expectedResult, "/:\na:\t%d\n", 5 * entry + 10);
+    list(listResult, "/");
+    CuAssertStrEquals(tc, expectedResult, listResult);
+    sprintf(expectedResult, "/a:\nb:\t%d\nc:\t%d\n", entry + 6, 2 * entry + 4);
+    list(listResult, "/a");
+    CuAssertStrEquals(tc, expectedResult, listResult);
+}
+
+void TestReadDirectory(CuTest *tc) {
+    format("test read directory");
+    char path[16];
+    for (int i = 0; i < 100; i++) {
+        sprintf(path, "/big/f%d", i);
+        CuAssertIntEquals(tc, 0, create(path));
+    }
+    CuAssertIntEquals(tc, 0, create("/big/sub/x"));
+    CuAssertIntEquals(tc, 0, a2write("/big/f7", "seven", 6));
+
+    int dh = fsOpenDir("/big");
+    CuAssertTrue(tc, dh >= 0);
+    struct DirEntry entry;
+    int files = 0, dirs = 0;
+    while (fsReadDir(dh, &entry) == 1) {
+        if (entry.type == 'D') {
+            dirs++;
+            CuAssertStrEquals(tc, "sub", entry.name);
+            CuAssertIntEquals(tc, entrySize(), entry.size);
+        } else {
+            files++;
+            CuAssertIntEquals(tc, strcmp(entry.name, "f7") == 0 ? 6 : 0, entry.size);
+        }
+    }
+    CuAssertIntEquals(tc, 100, files);
+    CuAssertIntEquals(tc, 1, dirs);
+    CuAssertIntEquals(tc, 0, fsReadDir(dh, &entry));
+    CuAssertIntEquals(tc, 0, fsCloseDir(dh));
+    CuAssertIntEquals(tc, -1, fsReadDir(dh, &entry));
+    CuAssertIntEquals(tc, -1, fsOpenDir("/missing"));
+
+    // Summed over many batches: /big's index, files and sub entries, sub's entry and f7's data
+    dh = fsOpenDir("/");
+    CuAssertIntEquals(tc, 1, fsReadDir(dh, &entry));
+    CuAssertStrEquals(tc, "big", entry.name);
+    CuAssertIntEquals(tc, 103 * entrySize() + 6, entry.size);
+    CuAssertIntEquals(tc, 0, fsCloseDir(dh));
+}
+
+void TestAsyncBlockIO(CuTest *tc) {
+    unsigned char out[4 * blockSize()];
+    unsigned char in[4 * blockSize()];
+    for (int i = 0; i < 4 * blockSize(); i++) {
+        out[i] = (unsigned char)i;
+    }
+
+    int low = numBlocks() / 4;
+    int high = numBlocks() / 2;
+    int first = blockWriteAsync(low, 2, out);
+    int second = blockWriteAsync(high, 2, out + 2 * blockSize());
+    CuAssertTrue(tc, first >= 0 && second >= 0);
+    CuAssertIntEquals(tc, 0, blockWait(second));
+    CuAssertIntEquals(tc, 0, blockWait(first));
+
+    int blocks[4] = {low, low + 1, high, high + 1};
+    unsigned char *bufs[4] = {in, in + blockSize(), in + 2 * blockSize(), in + 3 * blockSize()};
+    CuAssertIntEquals(tc, 0, blockReadv(blocks, bufs, 4));
+    CuAssertTrue(tc, memcmp(out, in, sizeof(out)) == 0);
+
+    CuAssertIntEquals(tc, -1, blockReadAsync(numBlocks(), 1, in));
+    CuAssertIntEquals(tc, -1, blockWait(first));
+}
+
+void TestWideLayout(CuTest *tc) {
+    CuAssertIntEquals(tc, -1, formatLayout("bad layout", 7));
+    CuAssertIntEquals(tc, 0, formatLayout("test wide layout", FS_WF2));
+    unsigned char header[blockSize()];
+    CuAssertIntEquals(tc, 0, blockRead(1, header));
+    CuAssertTrue(tc, memcmp(header, "WF2", 3) == 0);
+
+    // Entries are 16 bytes, with 32 bit start blocks and sizes
+    CuAssertIntEquals(tc, 0, create("/a/b/file"));
+    char listResult[4096];
+    list(listResult, "/");
+    CuAssertStrEquals(tc, "/:\na:\t32\n", listResult);
+
+    char path[16];
+    for (int i = 0; i < 100; i++) {
+        sprintf(path, "/a/f%d", i);
+        CuAssertIntEquals(tc, 0, create(path));
+    }
+    CuAssertIntEquals(tc, -1, create("/a/f42"));
+
+    int length = 20000;
+    char *data = malloc(length);
+    char *back = malloc(length);
+    for (int i = 0; i < length; i++) {
+        data[i] = (char)(i * 7);
+    }
+    CuAssertIntEquals(tc, 0, a2write("/a/f99", data, length));
+    CuAssertIntEquals(tc, 0, a2write("/a/f99", data, length));
+    CuAssertIntEquals(tc, 0, a2read("/a/f99", back, length));
+    CuAssertIntEquals(tc, 0, a2read("/a/f99", back, length));
+    CuAssertTrue(tc, memcmp(data, back, length) == 0);
+    free(data);
+    free(back);
+
+    list(listResult, "/a");
+    CuAssertTrue(tc, strstr(listResult, "\nf99:\t40000\n") != NULL);
+
+    // format picks a wide layout for devices with room for files over 65535 bytes, or too many blocks
+    int geometries[3][2] = {{64, 1024}, {64, 4096}, {64, 70000}};
+    char *ids[3] = {"WFL2", "WFL4", "WFL4"};
+    for (int i = 0; i < 3; i++) {
+        struct DeviceOptions fileOptions = {DEVICE_PREAD, "test_layout_file", geometries[i][0], geometries[i][1], DEVICE_SPARSE, 0};
+        struct wfs_mount *m = fsMount(NULL, &fileOptions);
+        CuAssertPtrNotNull(tc, m);
+        CuAssertIntEquals(tc, 0, format_m(m, "test chosen layout"));
+        CuAssertIntEquals(tc, 0, fsUnmount(m));
+        struct Device *dev = openDevice(&fileOptions);
+        CuAssertPtrNotNull(tc, dev);
+        struct Device *previous = useDevice(dev);
+        int read = blockRead(1, header);
+        useDevice(previous);
+        closeDevice(dev);
+        CuAssertIntEquals(tc, 0, read);
+        CuAssertTrue(tc, memcmp(header, ids[i], 4) == 0);
+    }
+    remove("test_layout_file");
+
+    // Files grow past 65535 bytes on the wide layouts, writes that would pass it fail on the narrow ones
+    struct DeviceOptions ramOptions = {DEVICE_RAM, NULL, 512, 512, DEVICE_SPARSE, 0};
+    struct wfs_mount *m = fsMount(NULL, &ramOptions);
+    CuAssertPtrNotNull(tc, m);
+    length = 70000;
+    data = malloc(length);
+    back = malloc(length);
+    for (int i = 0; i < length; i++) {
+        data[i] = (char)(i * 13);
+    }
+    int fsLayouts[4] = {FS_WF2, FS_WFL4, FS_WFS, FS_WFL2};
+    for (int l = 0; l < 4; l++) {
+        CuAssertIntEquals(tc, 0, formatLayout_m(m, "test file sizes", fsLayouts[l]));
+        CuAssertIntEquals(tc, 0, create_m(m, "/d/big"));
+        CuAssertIntEquals(tc, 0, a2write_m(m, "/d/big", data, 65000));
+        int handle = fsOpen_m(m, "/d/big");
+        CuAssertTrue(tc, handle >= 0);
+        if (l < 2) {
+            CuAssertIntEquals(tc, 0, fsWrite_m(m, handle, data + 65000, length - 65000));
+            CuAssertIntEquals(tc, 0, fsRead_m(m, handle, back, length));
+            CuAssertTrue(tc, memcmp(data, back, length) == 0);
+            list_m(m, listResult, "/d");
+            CuAssertStrEquals(tc, "/d:\nbig:\t70000\n", listResult);
+        } else {
+            CuAssertIntEquals(tc, -1, fsWrite_m(m, handle, data + 65000, length - 65000));
+            CuAssertIntEquals(tc, ENOROOM, file_errno);
+            CuAssertTrue(tc, a2write_m(m, "/d/big", data + 65000, 536) < 0);
+            CuAssertIntEquals(tc, ENOROOM, file_errno);
+            CuAssertIntEquals(tc, 0, a2write_m(m, "/d/big", data + 65000, 535));
+            CuAssertIntEquals(tc, 0, fsRead_m(m, handle, back, 65535));
+            CuAssertTrue(tc, memcmp(data, back, 65535) == 0);
+            list_m(m, listResult, "/d");
+            CuAssertStrEquals(tc, "/d:\nbig:\t65535\n", listResult);
+        }
+        CuAssertIntEquals(tc, 0, fsClose_m(m, handle));
+    }
+    CuAssertIntEquals(tc, 0, fsUnmount(m));
+    free(data);
+    free(back);
+}
+
+void TestConvertLayout(CuTest *tc) {
+    int from[2] = {FS_WFS, FS_WF2};
+    char *to[2] = {"WFL2", "WFL4"};
+    for (int l = 0; l < 2; l++) {
+        CuAssertIntEquals(tc, 0, formatLayout("test convert layout", from[l]));
+        char path[16];
+        for (int i = 0; i < 80; i++) {
+            sprintf(path, "/big/f%d", i);
+            CuAssertIntEquals(tc, 0, create(path));
+        }
+        CuAssertIntEquals(tc, 0, create("/big/sub/x"));
+        CuAssertIntEquals(tc, 0, a2write("/big/sub/x", "nested", 7));
+        CuAssertIntEquals(tc, 0, a2write("/big/f50", "fifty", 6));
+        char before[4096];
+        list(before, "/big");
+
+        CuAssertIntEquals(tc, 0, convertLayout());
+        unsigned char header[blockSize()];
+        CuAssertIntEquals(tc, 0, blockRead(1, header));
+        CuAssertTrue(tc, memcmp(header, to[l], 4) == 0);
+        CuAssertIntEquals(tc, 0, convertLayout());
+
+        char after[4096];
+        list(after, "/big");
+        CuAssertStrEquals(tc, before, after);
+        char readResult[8];
+        CuAssertIntEquals(tc, 0, a2read("/big/sub/x", readResult, 7));
+        CuAssertStrEquals(tc, "nested", readResult);
+        CuAssertIntEquals(tc, -1, create("/big/f42"));
+        CuAssertIntEquals(tc, 0, create("/big/f80"));
+        CuAssertIntEquals(tc, 0, a2write("/big/f80", "new", 4));
+        CuAssertIntEquals(tc, 0, a2read("/big/f50", readResult, 6));
+        CuAssertStrEquals(tc, "fifty", readResult);
+    }
+}
+
+void TestZeroBlocks(CuTest *tc) {
+    int start = numBlocks() / 4;
+    int count = (numBlocks() / 2 < 200) ? numBlocks() / 2 : 200; // spans several pages, with ragged ends for the smaller block sizes
+    unsigned char *data = malloc(count * blockSize());
+    memset(data, 0x5a, count * blockSize());
+    CuAssertIntEquals(tc, 0, blockWriteRange(start, count, data));
+    CuAssertIntEquals(tc, 0, blockZeroRange(start + 1, count - 2));
+
+    CuAssertIntEquals(tc, 0, blockReadRange(start, count, data));
+    CuAssertIntEquals(tc, 0x5a, data[blockSize() - 1]);
+    CuAssertIntEquals(tc, 0x5a, data[(count - 1) * blockSize()]);
+    int zeros = 0;
+    for (int i = blockSize(); i < (count - 1) * blockSize(); i++) {
+        zeros += (data[i] == 0);
+    }
+    CuAssertIntEquals(tc, (count - 2) * blockSize(), zeros);
+    CuAssertIntEquals(tc, -1, blockZeroRange(numBlocks() - 1, 2));
+    free(data);
+}
+
+void TestDiscardBlocks(CuTest *tc) {
+    // Discarded blocks are undefined until written again, the blocks around them are kept
+    int start = numBlocks() - 8;
+    unsigned char *data = malloc(8 * blockSize());
+    memset(data, 0x33, 8 * blockSize());
+    CuAssertIntEquals(tc, 0, blockWriteRange(start, 8, data));
+    CuAssertIntEquals(tc, 0, blockDiscard(start + 2, 4));
+    CuAssertIntEquals(tc, 0, blockReadRange(start, 8, data));
+    CuAssertIntEquals(tc, 0x33, data[2 * blockSize() - 1]);
+    CuAssertIntEquals(tc, 0x33, data[6 * blockSize()]);
+    CuAssertIntEquals(tc, 0x33, data[8 * blockSize() - 1]);
+    memset(data, 0x44, 4 * blockSize());
+    CuAssertIntEquals(tc, 0, blockWriteRange(start + 2, 4, data));
+    memset(data, 0, 8 * blockSize());
+    CuAssertIntEquals(tc, 0, blockReadRange(start, 8, data));
+    CuAssertIntEquals(tc, 0x33, data[0]);
+    CuAssertIntEquals(tc, 0x44, data[2 * blockSize()]);
+    CuAssertIntEquals(tc, 0x44, data[6 * blockSize() - 1]);
+    CuAssertIntEquals(tc, -1, blockDiscard(-1, 2));
+    CuAssertIntEquals(tc, -1, blockDiscard(start, 9));
+    free(data);
+
+    // Freed blocks are queued and discarded as the directory index is rebuilt
+    format("test discard");
+    int files = (numBlocks() / 2 < 300) ? numBlocks() / 2 : 300; // each file takes a block
+    char path[16];
+    for (int i = 0; i < files; i++) {
+        sprintf(path, "/d/f%d", i);
+        CuAssertIntEquals(tc, 0, create(path));
+    }
+    sprintf(path, "/d/f%d", files - 1);
+    CuAssertIntEquals(tc, 0, a2write(path, "kept", 5));
+    char readResult[8];
+    CuAssertIntEquals(tc, 0, a2read(path, readResult, 5));
+    CuAssertStrEquals(tc, "kept", readResult);
+    sprintf(path, "/d/f%d", files / 2);
+    CuAssertIntEquals(tc, -1, create(path));
+}
+
+#define PARALLEL_WRITERS 8
+#define PARALLEL_CHUNKS 40
+
+/* Appends numbered chunks to a file in a directory of its own, one in a shared directory and one shared by every writer. */
+void *parallelWriter(void *arg) {
+    int id = *(int *)arg;
+    char ownPath[16];
+    char sharedPath[16];
+    char chunk[16];
+    int failures = 0;
+
+    sprintf(ownPath, "/t%d/own", id);
+    sprintf(sharedPath, "/shared/s%d", id);
+    failures += create(ownPath) != 0;
+    failures += create(sharedPath) != 0;
+    int handle = fsOpen(ownPath);
+    for (int i = 0; i < PARALLEL_CHUNKS; i++) {
+        sprintf(chunk, "%02d:%02d-----", id, i);
+        failures += fsWrite(handle, chunk, 10) != 0;
+        failures += a2write(sharedPath, chunk, 10) != 0;
+        failures += a2write("/all", chunk, 10) != 0;
+    }
+    failures += fsClose(handle) != 0;
+    return (void *)(intptr_t)failures;
+}
+
+void TestParallelWrites(CuTest *tc) {
+    format("test parallel writes");
+    CuAssertIntEquals(tc, 0, create("/all"));
+
+    pthread_t threads[PARALLEL_WRITERS];
+    int ids[PARALLEL_WRITERS];
+    for (int i = 0; i < PARALLEL_WRITERS; i++) {
+        ids[i] = i;
+        CuAssertIntEquals(tc, 0, pthread_create(&threads[i], NULL, parallelWriter, &ids[i]));
+    }
+    int failures = 0;
+    for (int i = 0; i < PARALLEL_WRITERS; i++) {
+        void *result;
+        pthread_join(threads[i], &result);
+        failures += (int)(intptr_t)result;
+    }
+    CuAssertIntEquals(tc, 0, failures);
+
+    // Each file holds its writer's chunks in order
+    char expected[PARALLEL_CHUNKS * 10 + 1];
+    char readResult[PARALLEL_CHUNKS * 10 + 1];
+    char path[16];
+    for (int id = 0; id < PARALLEL_WRITERS; id++) {
+        for (int i = 0; i < PARALLEL_CHUNKS; i++) {
+            sprintf(expected + i * 10, "%02d:%02d-----", id, i);
+        }
+        sprintf(path, "/t%d/own", id);
+        int handle = fsOpen(path);
+        CuAssertIntEquals(tc, 0, fsRead(handle, readResult, PARALLEL_CHUNKS * 10));
+        fsClose(handle);
+        readResult[PARALLEL_CHUNKS * 10] = '\0';
+        CuAssertStrEquals(tc, expected, readResult);
+        sprintf(path, "/shared/s%d", id);
+        CuAssertIntEquals(tc, 0, a2read(path, readResult, PARALLEL_CHUNKS * 10));
+        CuAssertStrEquals(tc, expected, readResult);
+    }
+
+    // The shared file has every chunk whole, each writer's in order
+    char *all = malloc(PARALLEL_WRITERS * PARALLEL_CHUNKS * 10);
+    CuAssertIntEquals(tc, 0, a2read("/all", all, PARALLEL_WRITERS * PARALLEL_CHUNKS * 10));
+    int next[PARALLEL_WRITERS] = {0};
+    for (int c = 0; c < PARALLEL_WRITERS * PARALLEL_CHUNKS; c++) {
+        int id = -1;
+        int i = -1;
+        CuAssertIntEquals(tc, 2, sscanf(all + c * 10, "%2d:%2d", &id, &i));
+        CuAssertTrue(tc, id >= 0 && id < PARALLEL_WRITERS);
+        CuAssertIntEquals(tc, next[id]++, i);
+    }
+    free(all);
+
+    char listResult[1024];
+    list(listResult, "/t3");
+    CuAssertStrEquals(tc, "/t3:\nown:\t400\n", listResult);
+    list(listResult, "/");
+    CuAssertTrue(tc, strstr(listResult, "all:\t3200\n") != NULL);
+}
+
+#define ERROR_ROUNDS 200
+
+/* Makes calls that fail with ENOSUCHFILE, checking its own file_errno is never changed by another thread. */
+void *missingFileReader(void *arg) {
+    char data[4];
+    int mismatches = 0;
+    for (int i = 0; i < ERROR_ROUNDS; i++) {
+        mismatches += a2read("/missing", data, 4) != -1;
+        mismatches += file_errno != ENOSUCHFILE;
+    }
+    return (void *)(intptr_t)mismatches;
+}
+
+void TestThreadErrors(CuTest *tc) {
+    format("test thread errors");
+    CuAssertIntEquals(tc, 0, create_r("/file"));
+
+    pthread_t reader;
+    CuAssertIntEquals(tc, 0, pthread_create(&reader, NULL, missingFileReader, NULL));
+    int mismatches = 0;
+    for (int i = 0; i < ERROR_ROUNDS; i++) {
+        // Fails with a different error while the reader fails with ENOSUCHFILE
+        CuAssertIntEquals(tc, -1, create("/toolongname"));
+        mismatches += file_errno == ENOSUCHFILE;
+    }
+    void *result;
+    pthread_join(reader, &result);
+    CuAssertIntEquals(tc, 0, (int)(intptr_t)result);
+    CuAssertIntEquals(tc, 0, mismatches);
+
+    // The _r calls return the error rather than -1
+    char data[8];
+    int handle;
+    int found;
+    struct DirEntry entry;
+    CuAssertIntEquals(tc, ENOSUCHFILE, a2read_r("/missing", data, 4));
+    CuAssertIntEquals(tc, ENOSUCHFILE, fsOpen_r("/missing", &handle));
+    CuAssertIntEquals(tc, -1, handle);
+    CuAssertIntEquals(tc, 0, a2write_r("/file", "abcd", 4));
+    CuAssertIntEquals(tc, 0, fsOpen_r("/file", &handle));
+    CuAssertIntEquals(tc, 0, fsRead_r(handle, data, 4));
+    CuAssertTrue(tc, fsRead_r(handle, data, 4) > 0);
+    CuAssertIntEquals(tc, 0, fsClose_r(handle));
+    CuAssertTrue(tc, fsClose_r(handle) > 0);
+
+    // Only a full handle table is EOTHER
+    int handles[1024];
+    int opened = 0;
+    while (opened < 1024 && (handles[opened] = fsOpen("/file")) >= 0) {
+        opened++;
+    }
+    CuAssertTrue(tc, opened < 1024);
+    CuAssertIntEquals(tc, EOTHER, fsOpen_r("/file", &handle));
+    CuAssertIntEquals(tc, ENOSUCHFILE, fsOpen_r("/missing", &handle));
+    for (int i = 0; i < opened; i++) {
+        CuAssertIntEquals(tc, 0, fsClose(handles[i]));
+    }
+
+    CuAssertIntEquals(tc, 0, fsOpenDir_r("/", &handle));
+    CuAssertIntEquals(tc, 0, fsReadDir_r(handle, &entry, &found));
+    CuAssertIntEquals(tc, 1, found);
+    CuAssertStrEquals(tc, "file", entry.name);
+    CuAssertIntEquals(tc, 0, fsReadDir_r(handle, &entry, &found));
+    CuAssertIntEquals(tc, 0, found);
+    CuAssertIntEquals(tc, 0, fsCloseDir_r(handle));
+    char listResult[64];
+    CuAssertIntEquals(tc, ENOSUCHFILE, list_r(listResult, "/missing"));
+    CuAssertIntEquals(tc, 0, list_r(listResult, "/"));
+
+    // A listing that fails after its header fails as a whole
+    CuAssertIntEquals(tc, 0, create_r("/d/sub/x"));
+    CuAssertIntEquals(tc, 0, fsOpenDir_r("/", &handle));
+    do {
+        CuAssertIntEquals(tc, 0, fsReadDir_r(handle, &entry, &found));
+    } while (found && strcmp(entry.name, "d") != 0);
+    CuAssertIntEquals(tc, 0, fsCloseDir_r(handle));
+    unsigned char block[blockSize()];
+    CuAssertIntEquals(tc, 0, blockRead(entry.startBlock, block));
+    CuAssertStrEquals(tc, "sub", (char *)block);
+    memset(block + 8, 0x7f, (entrySize() - 8) / 2); // sub's start block, past the end of the device
+    CuAssertIntEquals(tc, 0, blockWrite(entry.startBlock, block));
+    CuAssertTrue(tc, list_r(listResult, "/d") != 0);
+    CuAssertStrEquals(tc, "/d:\n", listResult);
+}
+
+#define ALLOCATING_WRITERS 16
+#define ALLOCATING_ROUNDS 12
+
+/* Appends whole blocks of its own byte to a file of its own, so every append claims a block. */
+void *allocatingWriter(void *arg) {
+    int id = *(int *)arg;
+    char path[8];
+    unsigned char chunk[blockSize()];
+    int failures = 0;
+
+    sprintf(path, "/a%d", id);
+    memset(chunk, 'A' + id, blockSize());
+    failures += create(path) != 0;
+    for (int i = 0; i < ALLOCATING_ROUNDS; i++) {
+        failures += a2write(path, chunk, blockSize()) != 0;
+    }
+    return (void *)(intptr_t)failures;
+}
+
+/* Appends blocks to /fill until the device is full, returning how many fitted. */
+int fillDevice() {
+    unsigned char chunk[blockSize()];
+    memset(chunk, 'z', blockSize());
+    create("/fill");
+    int count = 0;
+    while (a2write("/fill", chunk, blockSize()) == 0) {
+        count++;
+    }
+    return count;
+}
+
+pthread_barrier_t holderBarrier;
+
+/* Writes a file, so blocks are left in its cache, and waits until the device has been filled before exiting. */
+void *idleHolder(void *arg) {
+    int id = 0;
+    void *failures = allocatingWriter(&id);
+    pthread_barrier_wait(&holderBarrier);
+    pthread_barrier_wait(&holderBarrier);
+    return failures;
+}
+
+void TestParallelAllocation(CuTest *tc) {
+    format("test parallel allocation");
+    pthread_t threads[ALLOCATING_WRITERS];
+    int ids[ALLOCATING_WRITERS];
+    for (int i = 0; i < ALLOCATING_WRITERS; i++) {
+        ids[i] = i;
+        CuAssertIntEquals(tc, 0, pthread_create(&threads[i], NULL, allocatingWriter, &ids[i]));
+    }
+    int failures = 0;
+    for (int i = 0; i < ALLOCATING_WRITERS; i++) {
+        void *result;
+        pthread_join(threads[i], &result);
+        failures += (int)(intptr_t)result;
+    }
+    CuAssertIntEquals(tc, 0, failures);
+
+    // No block went to two files
+    unsigned char data[ALLOCATING_ROUNDS * blockSize()];
+    char path[8];
+    for (int id = 0; id < ALLOCATING_WRITERS; id++) {
+        sprintf(path, "/a%d", id);
+        CuAssertIntEquals(tc, 0, a2read(path, data, ALLOCATING_ROUNDS * blockSize()));
+        int wrong = 0;
+        for (int i = 0; i < ALLOCATING_ROUNDS * blockSize(); i++) {
+            wrong += data[i] != 'A' + id;
+        }
+        CuAssertIntEquals(tc, 0, wrong);
+    }
+
+    // The blocks the writers had claimed but not used went back when they exited,
+    // so as much fits as after writing the same files from one thread
+    int filled = fillDevice();
+    format("test parallel allocation");
+    for (int id = 0; id < ALLOCATING_WRITERS; id++) {
+        allocatingWriter(&id);
+    }
+    CuAssertIntEquals(tc, fillDevice(), filled);
+
+    // A full device takes back the blocks cached by threads still running
+    format("test parallel allocation");
+    pthread_t holder;
+    pthread_barrier_init(&holderBarrier, NULL, 2);
+    CuAssertIntEquals(tc, 0, pthread_create(&holder, NULL, idleHolder, NULL));
+    pthread_barrier_wait(&holderBarrier);
+    filled = fillDevice();
+    pthread_barrier_wait(&holderBarrier);
+    void *result;
+    pthread_join(holder, &result);
+    pthread_barrier_destroy(&holderBarrier);
+    CuAssertIntEquals(tc, 0, (int)(intptr_t)result);
+    format("test parallel allocation");
+    int id = 0;
+    allocatingWriter(&id);
+    CuAssertIntEquals(tc, fillDevice(), filled);
+}
+
+void TestAllocationGroups(CuTest *tc) {
+    format("test allocation groups");
+    char path[16];
+    for (int i = 0; i < 8; i++) {
+        sprintf(path, "/d%d/f", i);
+        CuAssertIntEquals(tc, 0, create(path));
+    }
+
+    // Devices of up to 7 bitmap words (448 blocks) have a single group, shared by every file
+    if ((numBlocks() + 63) / 64 < 8) {
+        return;
+    }
+
+    // The two directories furthest apart on the device are in different groups
+    int starts[8];
+    struct DirEntry entry;
+    int handle = fsOpenDir("/");
+    for (int i = 0; i < 8; i++) {
+        CuAssertIntEquals(tc, 1, fsReadDir(handle, &entry));
+        starts[entry.name[1] - '0'] = entry.startBlock;
+    }
+    fsCloseDir(handle);
+    int low = 0;
+    int high = 0;
+    for (int i = 1; i < 8; i++) {
+        low = (starts[i] < starts[low]) ? i : low;
+        high = (starts[i] > starts[high]) ? i : high;
+    }
+
+    // Blocks appended in turn to new files in them don't interleave
+    char lowPath[16];
+    char highPath[16];
+    sprintf(lowPath, "/d%d/g", low);
+    sprintf(highPath, "/d%d/g", high);
+    CuAssertIntEquals(tc, 0, create(lowPath));
+    CuAssertIntEquals(tc, 0, create(highPath));
+    unsigned char chunk[blockSize()];
+    for (int i = 0; i < 8; i++) {
+        memset(chunk, 'a' + i, blockSize());
+        CuAssertIntEquals(tc, 0, a2write(lowPath, chunk, blockSize()));
+        memset(chunk, 'A' + i, blockSize());
+        CuAssertIntEquals(tc, 0, a2write(highPath, chunk, blockSize()));
+    }
+    int lowStart = -1;
+    int highStart = -1;
+    sprintf(path, "/d%d", low);
+    handle = fsOpenDir(path);
+    while (fsReadDir(handle, &entry) == 1) {
+        lowStart = (strcmp(entry.name, "g") == 0) ? entry.startBlock : lowStart;
+    }
+    fsCloseDir(handle);
+    sprintf(path, "/d%d", high);
+    handle = fsOpenDir(path);
+    while (fsReadDir(handle, &entry) == 1) {
+        highStart = (strcmp(entry.name, "g") == 0) ? entry.startBlock : highStart;
+    }
+    fsCloseDir(handle);
+
+    // Each file is one run of blocks on the device
+    unsigned char block[blockSize()];
+    for (int i = 0; i < 8; i++) {
+        CuAssertIntEquals(tc, 0, blockRead(lowStart + i, block));
+        CuAssertIntEquals(tc, 'a' + i, block[0]);
+        CuAssertIntEquals(tc, 'a' + i, block[blockSize() - 1]);
+        CuAssertIntEquals(tc, 0, blockRead(highStart + i, block));
+        CuAssertIntEquals(tc, 'A' + i, block[0]);
+        CuAssertIntEquals(tc, 'A' + i, block[blockSize() - 1]);
+    }
+}
+
+#define MOUNT_WRITES 50
+
+/* Appends MOUNT_WRITES chunks naming its mount's volume to /f on it. */
+void *mountWriter(void *arg) {
+    struct wfs_mount *m = arg;
+    char name[64];
+    int failures = volumeName_m(m, name) != 0;
+    for (int i = 0; i < MOUNT_WRITES; i++) {
+        failures += a2write_m(m, "/f", name, 5) != 0;
+    }
+    return (void *)(intptr_t)failures;
+}
+
+void TestMounts(CuTest *tc) {
+    format("test mounts");
+    create("/default");
+
+    // Two volumes of different geometries, each written by a thread of its own
+    struct DeviceOptions firstOptions = {DEVICE_RAM, NULL, 128, 512, DEVICE_SPARSE, 0};
+    struct DeviceOptions secondOptions = {DEVICE_RAM, NULL, 64, 2048, DEVICE_SPARSE, 0};
+    struct wfs_mount *mounts[2] = {fsMount(NULL, &firstOptions), fsMount(NULL, &secondOptions)};
+    CuAssertPtrNotNull(tc, mounts[0]);
+    CuAssertPtrNotNull(tc, mounts[1]);
+    CuAssertIntEquals(tc, 0, format_m(mounts[0], "first"));
+    CuAssertIntEquals(tc, 0, format_m(mounts[1], "secnd"));
+    CuAssertIntEquals(tc, 0, create_m(mounts[0], "/f"));
+    CuAssertIntEquals(tc, 0, create_m(mounts[1], "/f"));
+
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) {
+        CuAssertIntEquals(tc, 0, pthread_create(&threads[i], NULL, mountWriter, mounts[i]));
+    }
+    int failures = 0;
+    for (int i = 0; i < 2; i++) {
+        void *result;
+        pthread_join(threads[i], &result);
+        failures += (int)(intptr_t)result;
+    }
+    CuAssertIntEquals(tc, 0, failures);
+
+    char data[MOUNT_WRITES * 5 + 1];
+    char listResult[256];
+    const char *names[2] = {"first", "secnd"};
+    for (int i = 0; i < 2; i++) {
+        int handle = fsOpen_m(mounts[i], "/f");
+        CuAssertIntEquals(tc, 0, fsRead_m(mounts[i], handle, data, MOUNT_WRITES * 5));
+        CuAssertIntEquals(tc, 0, fsClose_m(mounts[i], handle));
+        for (int j = 0; j < MOUNT_WRITES; j++) {
+            CuAssertIntEquals(tc, 0, memcmp(data + j * 5, names[i], 5));
+        }
+        list_m(mounts[i], listResult, "/");
+        CuAssertStrEquals(tc, "/:\nf:\t250\n", listResult);
+        CuAssertIntEquals(tc, 0, fsUnmount(mounts[i]));
+    }
+
+    // The default mount is untouched
+    list(listResult, "/");
+    CuAssertStrEquals(tc, "/:\ndefault:\t0\n", listResult);
+    CuAssertIntEquals(tc, -1, fsUnmount(NULL));
+
+    // A mount of a device file keeps its data when mounted again
+    struct DeviceOptions fileOptions = {DEVICE_PREAD, NULL, 64, 256, DEVICE_SPARSE, 0};
+    struct wfs_mount *m = fsMount("test_mount_file", &fileOptions);
+    CuAssertPtrNotNull(tc, m);
+    CuAssertIntEquals(tc, 0, format_m(m, "kept"));
+    CuAssertIntEquals(tc, 0, create_m(m, "/dir/kept"));
+    CuAssertIntEquals(tc, 0, a2write_m(m, "/dir/kept", "persist", 8));
+    CuAssertIntEquals(tc, 0, fsUnmount(m));
+    m = fsMount("test_mount_file", NULL);
+    CuAssertPtrNotNull(tc, m);
+    CuAssertIntEquals(tc, 0, a2read_m(m, "/dir/kept", data, 8));
+    CuAssertStrEquals(tc, "persist", data);
+    CuAssertIntEquals(tc, 0, fsUnmount(m));
+    remove("test_mount_file");
+}
+
+#define BACKEND_BLOCK_SIZE 512
+#define BACKEND_BLOCKS 64
+
+/*
+ * Checks a block of the current device holds value in every byte.
+ * Returns 1 if it does, 0 otherwise.
+ */
+int blockHolds(int blockNumber, unsigned char value) {
+    unsigned char block[BACKEND_BLOCK_SIZE];
+    if (blockRead(blockNumber, block)) {
+        return 0;
+    }
+    for (int i = 0; i < BACKEND_BLOCK_SIZE; i++) {
+        if (block[i] != value) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void TestBackends(CuTest *tc) {
+    // Each backend in turn writes its own blocks of one device file, and reads the others'
+    int backends[4] = {DEVICE_MMAP, DEVICE_PREAD, DEVICE_DIRECT, DEVICE_URING};
+    unsigned char data[3 * BACKEND_BLOCK_SIZE];
+    int wrong = 0;
+    remove("test_backend_file");
+    for (int b = 0; b < 4; b++) {
+        struct DeviceOptions options = {backends[b], "test_backend_file", BACKEND_BLOCK_SIZE, BACKEND_BLOCKS, DEVICE_SPARSE, 1};
+        struct Device *dev = openDevice(&options);
+        CuAssertPtrNotNull(tc, dev);
+        struct Device *previous = useDevice(dev);
+        wrong += blockSize() != BACKEND_BLOCK_SIZE || numBlocks() != BACKEND_BLOCKS;
+
+        // A lone block shares its sector with blocks left alone, a range and an async write don't
+        memset(data, 'a' + b, sizeof(data));
+        wrong += blockWrite(2 * b + 1, data) != 0;
+        wrong += blockWriteRange(16 + 4 * b, 3, data) != 0;
+        memset(data, 'A' + b, sizeof(data));
+        int request = blockWriteAsync(40 + 4 * b, 3, data);
+        wrong += request < 0 || blockWait(request) != 0;
+        for (int earlier = 0; earlier <= b; earlier++) {
+            wrong += !blockHolds(2 * earlier, 0) || !blockHolds(2 * earlier + 1, 'a' + earlier);
+            wrong += !blockHolds(16 + 4 * earlier, 'a' + earlier) || !blockHolds(40 + 4 * earlier, 'A' + earlier);
+            wrong += !blockHolds(40 + 4 * earlier + 2, (earlier < b) ? 0 : 'A' + earlier);
+        }
+
+        // Later backends find the cleared block zeroed, the discarded one is left unchecked
+        wrong += blockDiscard(16 + 4 * b + 1, 1) != 0 || blockZeroRange(40 + 4 * b + 2, 1) != 0 || !blockHolds(40 + 4 * b + 2, 0);
+        wrong += !blockHolds(16 + 4 * b + 2, 'a' + b) || !blockHolds(40 + 4 * b + 1, 'A' + b);
+        wrong += blockRead(BACKEND_BLOCKS, data) != -1;
+        useDevice(previous);
+        closeDevice(dev);
+        CuAssertIntEquals(tc, 0, wrong);
+    }
+    remove("test_backend_file");
+
+    // A RAM disk starts out zeroed and keeps nothing once closed
+    struct DeviceOptions ramOptions = {DEVICE_RAM, NULL, BACKEND_BLOCK_SIZE, BACKEND_BLOCKS, DEVICE_SPARSE, 0};
+    for (int round = 0; round < 2; round++) {
+        struct Device *dev = openDevice(&ramOptions);
+        CuAssertPtrNotNull(tc, dev);
+        struct Device *previous = useDevice(dev);
+        wrong += !blockHolds(5, 0);
+        memset(data, 'r', sizeof(data));
+        wrong += blockWriteRange(5, 3, data) != 0 || !blockHolds(7, 'r');
+        useDevice(previous);
+        closeDevice(dev);
+    }
+    CuAssertIntEquals(tc, 0, wrong);
+}
+
+void TestPins(CuTest *tc) {
+    // Backends without a mapping hand out private copies, written back on unpin if mutable
+    int backends[2] = {DEVICE_PREAD, DEVICE_DIRECT};
+    const unsigned char *pinned[MAX_PINS + 1];
+    unsigned char data[3 * BACKEND_BLOCK_SIZE];
+    int wrong = 0;
+    remove("test_pin_file");
+    for (int b = 0; b < 2; b++) {
+        struct DeviceOptions options = {backends[b], "test_pin_file", BACKEND_BLOCK_SIZE, BACKEND_BLOCKS, DEVICE_SPARSE, 0};
+        struct Device *dev = openDevice(&options);
+        CuAssertPtrNotNull(tc, dev);
+        struct Device *previous = useDevice(dev);
+
+        // A mutable pin reaches the device on unpin, a read-only one never does
+        unsigned char *block = blockPinMut(10 + b);
+        wrong += block == NULL;
+        if (block != NULL) {
+            memset(block, 'p' + b, BACKEND_BLOCK_SIZE);
+            wrong += blockHolds(10 + b, 'p' + b);
+            wrong += blockUnpin(block) != 0 || !blockHolds(10 + b, 'p' + b);
+        }
+        const unsigned char *readOnly = blockPin(10 + b);
+        wrong += readOnly == NULL || readOnly[0] != 'p' + b;
+        if (readOnly != NULL) {
+            memset((unsigned char *)readOnly, 'x', BACKEND_BLOCK_SIZE);
+            wrong += blockUnpin(readOnly) != 0 || !blockHolds(10 + b, 'p' + b);
+        }
+
+        // A span holds its blocks one after another
+        memset(data, 's', BACKEND_BLOCK_SIZE);
+        memset(data + BACKEND_BLOCK_SIZE, 't', BACKEND_BLOCK_SIZE);
+        memset(data + 2 * BACKEND_BLOCK_SIZE, 'u', BACKEND_BLOCK_SIZE);
+        wrong += blockWriteRange(20, 3, data) != 0;
+        const unsigned char *span = blockSpan(20, 3);
+        wrong += span == NULL || memcmp(span, data, sizeof(data)) != 0;
+        wrong += blockUnpin(span) != 0;
+        wrong += blockSpan(BACKEND_BLOCKS - 1, 2) != NULL || dev_errno != EBADBLOCK;
+
+        // Pins run out after MAX_PINS, and unpinning one makes room again
+        for (int i = 0; i < MAX_PINS; i++) {
+            pinned[i] = blockPin(i);
+            wrong += pinned[i] == NULL;
+        }
+        pinned[MAX_PINS] = blockPin(MAX_PINS);
+        wrong += pinned[MAX_PINS] != NULL || dev_errno != ETOOMANYPINS;
+        wrong += blockUnpin(pinned[0]) != 0;
+        pinned[0] = blockSpan(MAX_PINS, 2);
+        wrong += pinned[0] == NULL;
+        for (int i = 0; i < MAX_PINS; i++) {
+            wrong += blockUnpin(pinned[i]) != 0;
+        }
+
+        // An address that isn't pinned, or no longer is, can't be unpinned
+        wrong += blockUnpin(data) != -1 || dev_errno != EBADBLOCK;
+        wrong += blockUnpin(pinned[0]) != -1;
+        useDevice(previous);
+        closeDevice(dev);
+        CuAssertIntEquals(tc, 0, wrong);
+    }
+    remove("test_pin_file");
+
+    // A mapped device hands out the mapping itself, so there is no limit and writes land at once
+    struct DeviceOptions ramOptions = {DEVICE_RAM, NULL, BACKEND_BLOCK_SIZE, BACKEND_BLOCKS, DEVICE_SPARSE, 0};
+    struct Device *dev = openDevice(&ramOptions);
+    CuAssertPtrNotNull(tc, dev);
+    struct Device *previous = useDevice(dev);
+    for (int i = 0; i <= MAX_PINS; i++) {
+        pinned[i] = blockPin(i);
+        wrong += pinned[i] == NULL;
+    }
+    unsigned char *block = blockPinMut(30);
+    wrong += block == NULL;
+    if (block != NULL) {
+        memset(block, 'm', BACKEND_BLOCK_SIZE);
+        wrong += !blockHolds(30, 'm') || blockUnpin(block) != 0;
+    }
+    for (int i = 0; i <= MAX_PINS; i++) {
+        wrong += blockUnpin(pinned[i]) != 0;
+    }
+    useDevice(previous);
+    closeDevice(dev);
+    CuAssertIntEquals(tc, 0, wrong);
+}
@@ -0,0 +1,99 @@
+/*
+ * throughput.c
+ *
+ *      Measures how appending scales with the number of writers.
+ *      Each writer appends to a file of its own on a 256MB RAM disk
+ *      until, between them, they have written 128MB. The run is
+ *      repeated with 1, 4 and 16 writers, or with the writer counts
+ *      given on the command line.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "device.h"
+#include "fileSystem.h"
+
+#define BLOCK_SIZE 4096
+#define NUM_BLOCKS 65536
+#define TOTAL_BYTES (128 << 20)
+#define CHUNK 4096 // bytes per fsWrite
+#define MAX_WRITERS 64
+
+struct wfs_mount *disk;
+int writeLength; // bytes each writer appends
+
+void *writer(void *arg) {
+	char path[16];
+	unsigned char chunk[CHUNK];
+	for (int i = 0; i < CHUNK; i++)
+		chunk[i] = (unsigned char)i;
+	sprintf(path, "/w%ld", (long)arg);
+	if (create_m(disk, path))
+		return (void *)1;
+	int fh = fsOpen_m(disk, path);
+	if (fh < 0)
+		return (void *)1;
+	for (int done = 0; done < writeLength; done += CHUNK) {
+		if (fsWrite_m(disk, fh, chunk, CHUNK))
+			return (void *)1;
+	}
+	return (void *)(long)fsClose_m(disk, fh);
+}
+
+/*
+ * Formats the disk and has writers threads append TOTAL_BYTES between them.
+ * Returns the seconds taken, or -1 if a write failed.
+ */
+double run(int writers) {
+	pthread_t threads[MAX_WRITERS];
+	struct timespec start, end;
+	if (format_m(disk, "throughput"))
+		return -1;
+	writeLength = TOTAL_BYTES / writers / CHUNK * CHUNK;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < writers; i++)
+		pthread_create(&threads[i], NULL, writer, (void *)i);
+	int failed = 0;
+	for (int i = 0; i < writers; i++) {
+		void *result;
+		pthread_join(threads[i], &result);
+		failed |= result != NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return failed ? -1 : (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	int counts[MAX_WRITERS] = {1, 4, 16};
+	int runs = 3;
+	if (argc > 1) {
+		runs = argc - 1 < MAX_WRITERS ? argc - 1 : MAX_WRITERS;
+		for (int i = 0; i < runs; i++) {
+			counts[i] = atoi(argv[i + 1]);
+			if (counts[i] < 1 || counts[i] > MAX_WRITERS) {
+				fprintf(stderr, "usage: %s [writers (1 to %d)] ...\n", argv[0], MAX_WRITERS);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	struct DeviceOptions options = {DEVICE_RAM, NULL, BLOCK_SIZE, NUM_BLOCKS, DEVICE_SPARSE, 0};
+	disk = fsMount(NULL, &options);
+	if (disk == NULL) {
+		fprintf(stderr, "unable to mount a RAM disk\n");
+		return EXIT_FAILURE;
+	}
+	printf("writers\tseconds\tMB/s\n");
+	for (int i = 0; i < runs; i++) {
+		double seconds = run(counts[i]);
+		if (seconds < 0) {
+			fprintf(stderr, "writing with %d writers failed\n", counts[i]);
+			return EXIT_FAILURE;
+		}
+		printf("%d\t%.3f\t%.1f\n", counts[i], seconds, (double)writeLength * counts[i] / (1 << 20) / seconds);
+	}
+	fsUnmount(disk);
+	return EXIT_SUCCESS;
+}